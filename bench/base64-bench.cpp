@@ -0,0 +1,180 @@
+/*
+ * QDigiDocCrypto
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include "crypto/Base64.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+// Decoder used by CryptoDocPrivate::fromBase64 before Base64, works on UTF-16 text
+static size_t legacyDecode(const std::u16string &data, char *result)
+{
+	unsigned int buf = 0;
+	int nbits = 0;
+	size_t offset = 0;
+	for( size_t i = 0; i < data.size(); ++i )
+	{
+		int ch = data[i] < 0x100 ? data[i] : 0;
+		int d;
+
+		if (ch >= 'A' && ch <= 'Z')
+			d = ch - 'A';
+		else if (ch >= 'a' && ch <= 'z')
+			d = ch - 'a' + 26;
+		else if (ch >= '0' && ch <= '9')
+			d = ch - '0' + 52;
+		else if (ch == '+')
+			d = 62;
+		else if (ch == '/')
+			d = 63;
+		else
+			continue;
+
+		buf = (buf << 6) | unsigned(d);
+		nbits += 6;
+		if(nbits >= 8)
+		{
+			nbits -= 8;
+			result[offset++] = char(buf >> nbits);
+			buf &= (1 << nbits) - 1;
+		}
+	}
+	return offset;
+}
+
+// Line wrapped like CDOC CipherValue, 64 characters per line
+static std::string encode(const std::vector<char> &data)
+{
+	static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	std::string result;
+	result.reserve(data.size() / 48 * 65 + 66);
+	int column = 0;
+	for(size_t i = 0; i < data.size(); i += 3)
+	{
+		size_t n = std::min<size_t>(3, data.size() - i);
+		unsigned int v = unsigned((unsigned char)data[i]) << 16;
+		if(n > 1) v |= unsigned((unsigned char)data[i + 1]) << 8;
+		if(n > 2) v |= unsigned((unsigned char)data[i + 2]);
+		char quantum[4] = { alphabet[v >> 18], alphabet[(v >> 12) & 63],
+			n > 1 ? alphabet[(v >> 6) & 63] : '=', n > 2 ? alphabet[v & 63] : '=' };
+		for(char c: quantum)
+		{
+			result += c;
+			if(++column == 64)
+			{
+				result += '\n';
+				column = 0;
+			}
+		}
+	}
+	if(column > 0)
+		result += '\n';
+	return result;
+}
+
+// Encoder used by CryptoDocPrivate::writeBase64 before Base64, data.mid(i, 48).toBase64() + "\n"
+static size_t legacyEncode(const std::vector<char> &data, std::string &result)
+{
+	result.clear();
+	for(size_t i = 0; i < data.size(); i += 48)
+	{
+		std::vector<char> line(data.begin() + i, data.begin() + std::min(i + 48, data.size()));
+		result += encode(line);
+	}
+	return result.size();
+}
+
+template<class F>
+static double measure(size_t bytes, int rounds, F f)
+{
+	double best = 0;
+	for(int i = 0; i < rounds; ++i)
+	{
+		auto start = std::chrono::steady_clock::now();
+		f();
+		double sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		best = std::max(best, bytes / sec / 1e6);
+	}
+	return best;
+}
+
+int main(int argc, char *argv[])
+{
+	size_t size = (argc > 1 ? size_t(atoi(argv[1])) : 64) * 1024 * 1024;
+	const int rounds = 5;
+
+	std::vector<char> data(size);
+	std::mt19937 gen(0);
+	for(char &c: data)
+		c = char(gen());
+	std::string text = encode(data);
+	std::u16string utf16(text.begin(), text.end());
+	std::vector<char> out(Base64::decodeSize(text.size()));
+
+	static const struct { Base64::Implementation impl; const char *name; } impls[] = {
+		{ Base64::Scalar, "scalar" }, { Base64::SSSE3, "ssse3" }, { Base64::AVX2, "avx2" } };
+
+	printf("decode %zu bytes of base64, MB/s of input, best of %d\n", text.size(), rounds);
+	size_t len = 0;
+	double legacy = measure(text.size(), rounds, [&]{ len = legacyDecode(utf16, out.data()); });
+	printf("%-8s %8.0f\n", "legacy", legacy);
+	if(len != size || memcmp(out.data(), data.data(), size) != 0)
+		return printf("legacy decoder mismatch\n"), 1;
+	for(const auto &i: impls)
+	{
+		if(!Base64::setImplementation(i.impl))
+		{
+			printf("%-8s %8s\n", i.name, "n/a");
+			continue;
+		}
+		double speed = measure(text.size(), rounds, [&]{
+			Base64::State state;
+			len = Base64::decode(text.data(), text.size(), out.data(), state);
+		});
+		printf("%-8s %8.0f %6.1fx\n", i.name, speed, speed / legacy);
+		if(len != size || memcmp(out.data(), data.data(), size) != 0)
+			return printf("%s decoder mismatch\n", i.name), 1;
+	}
+
+	printf("encode %zu bytes, MB/s of input, best of %d\n", size, rounds);
+	std::string legacyText;
+	legacy = measure(size, rounds, [&]{ len = legacyEncode(data, legacyText); });
+	printf("%-8s %8.0f\n", "legacy", legacy);
+	if(legacyText != text)
+		return printf("legacy encoder mismatch\n"), 1;
+	out.resize(Base64::encodeSize(size));
+	for(const auto &i: impls)
+	{
+		if(!Base64::setImplementation(i.impl))
+		{
+			printf("%-8s %8s\n", i.name, "n/a");
+			continue;
+		}
+		double speed = measure(size, rounds, [&]{ len = Base64::encode(data.data(), size, out.data()); });
+		printf("%-8s %8.0f %6.1fx\n", i.name, speed, speed / legacy);
+		if(len != text.size() || memcmp(out.data(), text.data(), len) != 0)
+			return printf("%s encoder mismatch\n", i.name), 1;
+	}
+	return 0;
+}
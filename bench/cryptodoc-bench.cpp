@@ -0,0 +1,278 @@
+/*
+ * QDigiDocCrypto
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include "crypto/CDoc.h"
+#include "crypto/StreamFilter.h"
+#include "crypto/TempFile.h"
+
+#include <QtCore/QFile>
+#include <QtCore/QTemporaryDir>
+
+#include <openssl/aes.h>
+#include <openssl/ec.h>
+#include <openssl/evp.h>
+#include <openssl/x509.h>
+
+#include <zlib.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <random>
+
+// Heap allocations of C++ code and, on glibc, of Qt, OpenSSL and zlib
+static std::atomic<quint64> allocations{0};
+
+#ifdef __GLIBC__
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t count, size_t size);
+extern "C" void *__libc_realloc(void *p, size_t size);
+extern "C" void *malloc(size_t size) { ++allocations; return __libc_malloc(size); }
+extern "C" void *calloc(size_t count, size_t size) { ++allocations; return __libc_calloc(count, size); }
+extern "C" void *realloc(void *p, size_t size) { ++allocations; return __libc_realloc(p, size); }
+#else
+void* operator new(size_t size)
+{
+	++allocations;
+	if(void *p = malloc(size))
+		return p;
+	throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept { free(p); }
+#endif
+
+struct Result
+{
+	double mbs = 0, allocs = 0;
+};
+
+// Repeats op until 0.25 s have passed, at least once
+template<class F>
+static Result measure(qint64 bytes, F op)
+{
+	quint64 count = 0, start = allocations;
+	auto begin = std::chrono::steady_clock::now();
+	double sec = 0;
+	do
+	{
+		if(!op())
+		{
+			printf("operation failed\n");
+			exit(1);
+		}
+		++count;
+		sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+	} while(sec < 0.25);
+	Result r;
+	r.mbs = double(bytes) * count / sec / 1e6;
+	r.allocs = double(allocations - start) / count;
+	return r;
+}
+
+// Runs data through filter chain built by setup, output is discarded or kept in out
+static bool run(const QByteArray &data, const std::function<void (FilterChain &chain)> &setup, QByteArray *out = nullptr)
+{
+	if(out)
+		out->clear();
+	FunctionSink sink([&](const char *d, qint64 size) {
+		if(out)
+			out->append(d, int(size));
+		return true;
+	});
+	FilterChain chain(&sink);
+	setup(chain);
+	return chain.write(data.constData(), data.size()) && chain.finish();
+}
+
+// Self-signed P-384 certificate, serial makes every recipient unique
+static QByteArray recipient(EVP_PKEY *key, int serial)
+{
+	std::unique_ptr<X509, decltype(&X509_free)> x509(X509_new(), X509_free);
+	X509_set_version(x509.get(), 2);
+	ASN1_INTEGER_set(X509_get_serialNumber(x509.get()), serial);
+	X509_gmtime_adj(X509_get_notBefore(x509.get()), 0);
+	X509_gmtime_adj(X509_get_notAfter(x509.get()), 365 * 24 * 3600L);
+	X509_NAME *name = X509_get_subject_name(x509.get());
+	QByteArray cn = "BENCH,RECIPIENT," + QByteArray::number(serial);
+	X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_UTF8, (const unsigned char*)cn.constData(), -1, -1, 0);
+	X509_set_issuer_name(x509.get(), name);
+	X509_set_pubkey(x509.get(), key);
+	if(X509_sign(x509.get(), key, EVP_sha384()) <= 0)
+		return QByteArray();
+	QByteArray der(i2d_X509(x509.get(), nullptr), 0);
+	unsigned char *p = (unsigned char*)der.data();
+	i2d_X509(x509.get(), &p);
+	return der;
+}
+
+static void print(const char *name, qint64 size, const Result &r)
+{
+	printf("%-22s %10lld %10.0f %10.1f\n", name, size, r.mbs, r.allocs);
+}
+
+int main(int argc, char *argv[])
+{
+	// Sizes grow by 32x from 1 KB up to given MB, at most 1 GB
+	qint64 max = qBound<qint64>(1, argc > 1 ? atoll(argv[1]) : 32, 1024) * 1024 * 1024;
+	std::mt19937 gen(0);
+
+	static const struct { const char *name; const EVP_CIPHER *cipher; } ciphers[] = {
+		{ "aes-128-cbc", EVP_aes_128_cbc() }, { "aes-192-cbc", EVP_aes_192_cbc() }, { "aes-256-cbc", EVP_aes_256_cbc() },
+		{ "aes-128-gcm", EVP_aes_128_gcm() }, { "aes-192-gcm", EVP_aes_192_gcm() }, { "aes-256-gcm", EVP_aes_256_gcm() } };
+
+	// Documents of CDoc benchmarks have 100 recipients sharing one key
+	std::unique_ptr<EVP_PKEY_CTX, decltype(&EVP_PKEY_CTX_free)> ctx(EVP_PKEY_CTX_new_id(EVP_PKEY_EC, nullptr), EVP_PKEY_CTX_free);
+	EVP_PKEY *pkey = nullptr;
+	if(!ctx || EVP_PKEY_keygen_init(ctx.get()) <= 0 ||
+		EVP_PKEY_CTX_set_ec_paramgen_curve_nid(ctx.get(), NID_secp384r1) <= 0 ||
+		EVP_PKEY_keygen(ctx.get(), &pkey) <= 0)
+		return printf("failed to generate key\n"), 1;
+	std::unique_ptr<EVP_PKEY, decltype(&EVP_PKEY_free)> recipientKey(pkey, EVP_PKEY_free);
+	QList<CDocKey> recipients;
+	for(int i = 1; i <= 100; ++i)
+		recipients << CDocKey(recipient(recipientKey.get(), i));
+	QTemporaryDir tmp;
+	if(!tmp.isValid())
+		return printf("failed to create work directory\n"), 1;
+
+	printf("%-22s %10s %10s %10s\n", "benchmark", "bytes", "MB/s", "allocs/op");
+	for(qint64 size = 1024; size <= max; size *= 32)
+	{
+		QByteArray data(int(size), Qt::Uninitialized);
+		for(char &c: data)
+			c = char(gen());
+		// Comma separated rows as typical compressible export
+		QByteArray text;
+		for(int row = 0; text.size() < size; ++row)
+			text += QByteArray::number(row) + ",2018-01-01," + QByteArray::number(int(gen() % 100000)) + ",EUR,paid\n";
+		text.truncate(int(size));
+
+		QByteArray encoded;
+		run(data, [](FilterChain &chain) { chain.append(new Base64Encoder(chain.head())); }, &encoded);
+		print("base64-encode", size, measure(size, [&] {
+			return run(data, [](FilterChain &chain) { chain.append(new Base64Encoder(chain.head())); });
+		}));
+		print("base64-decode", size, measure(size, [&] {
+			return run(encoded, [](FilterChain &chain) { chain.append(new Base64Decoder(chain.head())); });
+		}));
+
+		for(const auto &c: ciphers)
+		{
+			QByteArray key(EVP_CIPHER_key_length(c.cipher), 'k');
+			bool cbc = EVP_CIPHER_mode(c.cipher) == EVP_CIPH_CBC_MODE;
+			auto encrypt = [&](FilterChain &chain) {
+				chain.append(new CipherFilter(c.cipher, key, true, chain.head()));
+				if(cbc)
+					chain.append(new PaddingFilter(true, chain.head()));
+			};
+			auto decrypt = [&](FilterChain &chain) {
+				if(cbc)
+					chain.append(new PaddingFilter(false, chain.head()));
+				chain.append(new CipherFilter(c.cipher, key, false, chain.head()));
+			};
+			QByteArray encrypted;
+			run(data, encrypt, &encrypted);
+			print((QByteArray(c.name) + "-encrypt").constData(), size, measure(size, [&] { return run(data, encrypt); }));
+			print((QByteArray(c.name) + "-decrypt").constData(), size, measure(size, [&] { return run(encrypted, decrypt); }));
+			if(size < StreamFilter::PARALLEL)
+				continue;
+			print((QByteArray(c.name) + "-decrypt-mt").constData(), size, measure(size, [&] {
+				return run(encrypted, [&](FilterChain &chain) {
+					if(cbc)
+						chain.append(new PaddingFilter(false, chain.head()));
+					CipherFilter *cipher = new CipherFilter(c.cipher, key, false, chain.head());
+					cipher->setParallel(true);
+					chain.append(cipher);
+				});
+			}));
+		}
+
+		QByteArray key(32, 'k');
+		print("aes-256-gcm-segmented", size, measure(size, [&] {
+			return run(data, [&](FilterChain &chain) {
+				chain.append(new SegmentFilter(EVP_aes_256_gcm(), key, true, 1024 * 1024, chain.head()));
+			});
+		}));
+
+		QByteArray compressed;
+		run(text, [](FilterChain &chain) { chain.append(new DeflateFilter(Z_DEFAULT_COMPRESSION, chain.head())); }, &compressed);
+		print("deflate-text", size, measure(size, [&] {
+			return run(text, [](FilterChain &chain) { chain.append(new DeflateFilter(Z_DEFAULT_COMPRESSION, chain.head())); });
+		}));
+		print("inflate-text", size, measure(size, [&] {
+			return run(compressed, [](FilterChain &chain) { chain.append(new InflateFilter(chain.head())); });
+		}));
+
+		// Document of one file, header parsing skips payload
+		QString path = tmp.filePath("data.bin"), cdoc = tmp.filePath("data.cdoc");
+		QFile in(path);
+		if(!in.open(QFile::WriteOnly|QFile::Truncate) || in.write(data) != data.size())
+			return printf("failed to write input\n"), 1;
+		in.close();
+		QFile::remove(cdoc);
+		CDoc plain;
+		plain.clear(cdoc);
+		if(!plain.addFile(path) || !plain.addKeys(recipients) || !plain.encrypt())
+			return printf("failed to encrypt input\n"), 1;
+		print("cdoc-open-100", size, measure(size, [&] {
+			CDoc doc;
+			return doc.open(cdoc) && doc.keys().size() == recipients.size();
+		}));
+
+		// DDOC container of one file, DataFile is decoded from container when read
+		CDoc container;
+		container.clear(tmp.filePath("data.ddoc"));
+		if(!container.addFile(path))
+			return printf("failed to add input\n"), 1;
+		FunctionSink discard([](const char *, qint64) { return true; });
+		print("ddoc-write", size, measure(size, [&] { return container.writeDDoc(&discard); }));
+		TempFile ddoc;
+		if(!ddoc.open() || !container.writeDDoc(&ddoc) || !ddoc.flush())
+			return printf("failed to write DDOC\n"), 1;
+		print("ddoc-read", size, measure(size, [&] {
+			CDoc doc;
+			doc.readDDoc(&ddoc);
+			return doc.files.size() == 1 && doc.files[0].read([](const char *, qint64) { return true; });
+		}));
+	}
+
+	// Transport key wrapping of ECC recipients, size is key length
+	QByteArray kek(32, 'k'), transport(32, 't'), wrapped(40, 0), unwrapped(32, 0);
+	AES_KEY aes;
+	print("aes-256-kw-wrap", transport.size(), measure(transport.size(), [&] {
+		return AES_set_encrypt_key((const unsigned char*)kek.constData(), 256, &aes) == 0 &&
+			AES_wrap_key(&aes, nullptr, (unsigned char*)wrapped.data(), (const unsigned char*)transport.constData(), 32) == 40;
+	}));
+	print("aes-256-kw-unwrap", transport.size(), measure(transport.size(), [&] {
+		return AES_set_decrypt_key((const unsigned char*)kek.constData(), 256, &aes) == 0 &&
+			AES_unwrap_key(&aes, nullptr, (unsigned char*)unwrapped.data(), (const unsigned char*)wrapped.constData(), 40) == 32;
+	}));
+
+	// Key derivation of ECC recipients, other info is document format, ephemeral P-384 key and certificate
+	QByteArray z(48, 'z'), otherInfo(1200, 'o');
+	print("concatkdf-sha384", z.size(), measure(z.size(), [&] {
+		return CDoc::concatKDF(QCryptographicHash::Sha384, 32, z, otherInfo).size() == 32;
+	}));
+	return unwrapped == transport ? 0 : 1;
+}
@@ -0,0 +1,374 @@
+/*
+ * QDigiDocCrypto
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+// Encrypts and decrypts generated files with CDoc, decryption uses local software key.
+// Every run is reported as JSON object with wall and CPU time, peak RSS and bytes written.
+//
+// Decrypted files are compared with input and multi-file documents are encrypted again from
+// decrypted DDOC, which reads DataFiles lazily from the container.
+//
+// cryptodoc-e2e-bench [--sizes 1K,1M,1G] [--files 1,100] [--recipients 1,100] [--keys rsa,ec] [--dir tmp]
+
+#include "crypto/CDoc.h"
+
+#include <QtCore/QCoreApplication>
+#include <QtCore/QCryptographicHash>
+#include <QtCore/QDir>
+#include <QtCore/QFile>
+#include <QtCore/QJsonArray>
+#include <QtCore/QJsonDocument>
+#include <QtCore/QJsonObject>
+#include <QtCore/QTemporaryDir>
+
+#include <openssl/ec.h>
+#include <openssl/evp.h>
+#include <openssl/rsa.h>
+#include <openssl/x509.h>
+
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <random>
+
+#ifdef Q_OS_UNIX
+#include <sys/resource.h>
+#endif
+
+struct Usage
+{
+	double wall = 0, cpu = 0;
+	qint64 peakRss = 0;
+};
+
+static double cpuTime()
+{
+#ifdef Q_OS_UNIX
+	rusage r;
+	getrusage(RUSAGE_SELF, &r);
+	return r.ru_utime.tv_sec + r.ru_stime.tv_sec + (r.ru_utime.tv_usec + r.ru_stime.tv_usec) / 1e6;
+#else
+	return 0;
+#endif
+}
+
+// Linux resets VmHWM when 5 is written to clear_refs, elsewhere peak is process lifetime maximum
+static void resetPeakRss()
+{
+	QFile f("/proc/self/clear_refs");
+	if(f.open(QFile::WriteOnly))
+		f.write("5");
+}
+
+static qint64 peakRss()
+{
+	QFile f("/proc/self/status");
+	if(f.open(QFile::ReadOnly))
+	{
+		for(const QByteArray &line: f.readAll().split('\n'))
+		{
+			if(line.startsWith("VmHWM:"))
+				return line.mid(6).trimmed().split(' ').value(0).toLongLong() * 1024;
+		}
+	}
+#ifdef Q_OS_UNIX
+	rusage r;
+	getrusage(RUSAGE_SELF, &r);
+#ifdef Q_OS_MAC
+	return r.ru_maxrss;
+#else
+	return qint64(r.ru_maxrss) * 1024;
+#endif
+#else
+	return 0;
+#endif
+}
+
+template<class F>
+static Usage measure(F f)
+{
+	resetPeakRss();
+	Usage u;
+	double cpu = cpuTime();
+	auto begin = std::chrono::steady_clock::now();
+	f();
+	u.wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+	u.cpu = cpuTime() - cpu;
+	u.peakRss = peakRss();
+	return u;
+}
+
+static std::shared_ptr<EVP_PKEY> generateKey(bool ec)
+{
+	std::unique_ptr<EVP_PKEY_CTX, decltype(&EVP_PKEY_CTX_free)> ctx(
+		EVP_PKEY_CTX_new_id(ec ? EVP_PKEY_EC : EVP_PKEY_RSA, nullptr), EVP_PKEY_CTX_free);
+	EVP_PKEY *key = nullptr;
+	if(!ctx || EVP_PKEY_keygen_init(ctx.get()) <= 0 ||
+		(ec && EVP_PKEY_CTX_set_ec_paramgen_curve_nid(ctx.get(), NID_secp384r1) <= 0) ||
+		(!ec && EVP_PKEY_CTX_set_rsa_keygen_bits(ctx.get(), 2048) <= 0) ||
+		EVP_PKEY_keygen(ctx.get(), &key) <= 0)
+		return nullptr;
+	return std::shared_ptr<EVP_PKEY>(key, EVP_PKEY_free);
+}
+
+// Self-signed certificates sharing one key pair, serial makes every recipient unique
+static QByteArray generateCert(EVP_PKEY *key, int serial)
+{
+	std::unique_ptr<X509, decltype(&X509_free)> x509(X509_new(), X509_free);
+	X509_set_version(x509.get(), 2);
+	ASN1_INTEGER_set(X509_get_serialNumber(x509.get()), serial);
+	X509_gmtime_adj(X509_get_notBefore(x509.get()), 0);
+	X509_gmtime_adj(X509_get_notAfter(x509.get()), 365 * 24 * 3600L);
+	X509_NAME *name = X509_get_subject_name(x509.get());
+	QByteArray cn = "BENCH,RECIPIENT," + QByteArray::number(serial);
+	X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_UTF8, (const unsigned char*)cn.constData(), -1, -1, 0);
+	X509_set_issuer_name(x509.get(), name);
+	X509_set_pubkey(x509.get(), key);
+	if(X509_sign(x509.get(), key, EVP_sha256()) <= 0)
+		return QByteArray();
+	QByteArray der(i2d_X509(x509.get(), nullptr), 0);
+	unsigned char *p = (unsigned char*)der.data();
+	i2d_X509(x509.get(), &p);
+	return der;
+}
+
+// Same operations as token in QSigner::decrypt
+static QByteArray agreement(EVP_PKEY *pkey, const CDocKey &key)
+{
+	std::unique_ptr<EVP_PKEY_CTX, decltype(&EVP_PKEY_CTX_free)> ctx(EVP_PKEY_CTX_new(pkey, nullptr), EVP_PKEY_CTX_free);
+	if(EVP_PKEY_base_id(pkey) == EVP_PKEY_RSA)
+	{
+		size_t size = 0;
+		if(EVP_PKEY_decrypt_init(ctx.get()) <= 0 ||
+			EVP_PKEY_CTX_set_rsa_padding(ctx.get(), RSA_PKCS1_PADDING) <= 0 ||
+			EVP_PKEY_decrypt(ctx.get(), nullptr, &size, (const unsigned char*)key.cipher.constData(), size_t(key.cipher.size())) <= 0)
+			return QByteArray();
+		QByteArray result(int(size), 0);
+		if(EVP_PKEY_decrypt(ctx.get(), (unsigned char*)result.data(), &size, (const unsigned char*)key.cipher.constData(), size_t(key.cipher.size())) <= 0)
+			return QByteArray();
+		result.resize(int(size));
+		return result;
+	}
+
+	// Ephemeral public key is uncompressed point on recipient curve
+	EC_KEY *ec = EC_KEY_new_by_curve_name(EC_GROUP_get_curve_name(EC_KEY_get0_group(EVP_PKEY_get0_EC_KEY(pkey))));
+	const unsigned char *p = (const unsigned char*)key.publicKey.constData();
+	std::unique_ptr<EVP_PKEY, decltype(&EVP_PKEY_free)> peer(EVP_PKEY_new(), EVP_PKEY_free);
+	if(!ec || !o2i_ECPublicKey(&ec, &p, key.publicKey.size()) || !EVP_PKEY_assign_EC_KEY(peer.get(), ec))
+	{
+		EC_KEY_free(ec);
+		return QByteArray();
+	}
+	size_t size = 0;
+	if(EVP_PKEY_derive_init(ctx.get()) <= 0 ||
+		EVP_PKEY_derive_set_peer(ctx.get(), peer.get()) <= 0 ||
+		EVP_PKEY_derive(ctx.get(), nullptr, &size) <= 0)
+		return QByteArray();
+	QByteArray z(int(size), 0);
+	if(EVP_PKEY_derive(ctx.get(), (unsigned char*)z.data(), &size) <= 0)
+		return QByteArray();
+
+	QCryptographicHash::Algorithm hash = QCryptographicHash::Sha256;
+	if(key.concatDigest.endsWith("sha384"))
+		hash = QCryptographicHash::Sha384;
+	else if(key.concatDigest.endsWith("sha512"))
+		hash = QCryptographicHash::Sha512;
+	quint32 keySize = key.method.endsWith("kw-aes128") ? 16 : key.method.endsWith("kw-aes192") ? 24 : 32;
+	return CDoc::concatKDF(hash, keySize, z, key.AlgorithmID + key.PartyUInfo + key.PartyVInfo);
+}
+
+static QList<qint64> parseSizes(const QString &list)
+{
+	QList<qint64> result;
+	for(QString item: list.split(',', QString::SkipEmptyParts))
+	{
+		qint64 unit = 1;
+		switch(item.right(1).toUpper().at(0).toLatin1())
+		{
+		case 'K': unit = 1024LL; break;
+		case 'M': unit = 1024LL * 1024; break;
+		case 'G': unit = 1024LL * 1024 * 1024; break;
+		default: break;
+		}
+		if(unit > 1)
+			item.chop(1);
+		result << item.toLongLong() * unit;
+	}
+	return result;
+}
+
+static bool writeFile(const QString &path, qint64 size, std::mt19937 &gen)
+{
+	QFile f(path);
+	if(!f.open(QFile::WriteOnly))
+		return false;
+	QByteArray chunk(1024 * 1024, Qt::Uninitialized);
+	for(char &c: chunk)
+		c = char(gen());
+	for(qint64 left = size; left > 0; left -= chunk.size())
+	{
+		qint64 len = qMin<qint64>(left, chunk.size());
+		if(f.write(chunk.constData(), len) != len)
+			return false;
+	}
+	return true;
+}
+
+static QByteArray fileHash(const QString &path)
+{
+	QFile f(path);
+	QCryptographicHash hash(QCryptographicHash::Sha256);
+	return f.open(QFile::ReadOnly) && hash.addData(&f) ? hash.result() : QByteArray();
+}
+
+// Decrypted contents must match input files with same name
+static bool sameFiles(const CDoc &doc, const QDir &in)
+{
+	for(const CDoc::File &file: doc.files)
+	{
+		QCryptographicHash hash(QCryptographicHash::Sha256);
+		if(!file.read([&](const char *data, qint64 size) { hash.addData(data, int(size)); return true; }) ||
+			hash.result() != fileHash(in.filePath(file.name)))
+			return false;
+	}
+	return !doc.files.isEmpty();
+}
+
+static qint64 dirSize(const QString &path)
+{
+	qint64 size = 0;
+	for(const QFileInfo &info: QDir(path).entryInfoList(QDir::Files))
+		size += info.size();
+	return size;
+}
+
+int main(int argc, char *argv[])
+{
+	QCoreApplication app(argc, argv);
+	app.setApplicationName("cryptodoc-e2e-bench");
+
+	QStringList args = app.arguments();
+	auto option = [&](const QString &name, const QString &value) {
+		int i = args.indexOf(name);
+		return i >= 0 && i + 1 < args.size() ? args[i + 1] : value;
+	};
+	QList<qint64> sizes = parseSizes(option("--sizes", "1K,1M,64M"));
+	QList<qint64> fileCounts = parseSizes(option("--files", "1,2,10"));
+	QList<qint64> recipientCounts = parseSizes(option("--recipients", "1,100"));
+	QStringList keyTypes = option("--keys", "rsa,ec").split(',', QString::SkipEmptyParts);
+	QTemporaryDir tmp(option("--dir", QDir::tempPath()) + "/cryptodoc-e2e-XXXXXX");
+	if(!tmp.isValid())
+		return fprintf(stderr, "Failed to create work directory\n"), 1;
+
+	std::mt19937 gen(0);
+	QJsonArray results;
+	int failures = 0;
+	for(const QString &type: keyTypes)
+	{
+		std::shared_ptr<EVP_PKEY> pkey = generateKey(type == "ec");
+		if(!pkey)
+			return fprintf(stderr, "Failed to generate %s key\n", qPrintable(type)), 1;
+		QList<CDocKey> recipients;
+		for(qint64 count: recipientCounts)
+		{
+			while(recipients.size() < count)
+				recipients << CDocKey(generateCert(pkey.get(), recipients.size() + 1));
+
+			for(qint64 files: fileCounts)
+			{
+				for(qint64 size: sizes)
+				{
+					QDir dir(tmp.path());
+					dir.mkpath("in");
+					dir.mkpath("out");
+					QStringList paths;
+					for(qint64 i = 0; i < files; ++i)
+					{
+						paths << dir.filePath(QStringLiteral("in/file%1.bin").arg(i));
+						if(!writeFile(paths.last(), qMax<qint64>(1, size / files), gen))
+							return fprintf(stderr, "Failed to write input\n"), 1;
+					}
+					QString cdoc = dir.filePath("bench.cdoc");
+
+					QJsonObject run{{"keys", type}, {"recipients", count}, {"files", files}, {"bytes", size}};
+					bool ok = false;
+					Usage encrypt = measure([&] {
+						CDoc doc;
+						doc.clear(cdoc);
+						for(const QString &path: paths)
+							doc.addFile(path);
+						for(qint64 i = 0; i < count; ++i)
+							doc.addKey(recipients[int(i)]);
+						ok = doc.encrypt();
+					});
+					run["encrypt"] = QJsonObject{{"ok", ok}, {"wall_s", encrypt.wall}, {"cpu_s", encrypt.cpu},
+						{"peak_rss", encrypt.peakRss}, {"bytes_written", QFileInfo(cdoc).size()}};
+					failures += ok ? 0 : 1;
+
+					ok = false;
+					Usage decrypt = measure([&] {
+						CDoc doc;
+						if(!doc.open(cdoc))
+							return;
+						CDocKey key = doc.keys().value(doc.findKey(recipients[0].der));
+						ok = doc.decrypt(key, [&](const CDocKey &k) { return agreement(pkey.get(), k); });
+						for(const CDoc::File &file: doc.files)
+							ok = ok && file.save(dir.filePath("out/" + file.name));
+					});
+					for(const QString &path: paths)
+						ok = ok && fileHash(path) == fileHash(dir.filePath("out/" + QFileInfo(path).fileName()));
+					run["decrypt"] = QJsonObject{{"ok", ok}, {"wall_s", decrypt.wall}, {"cpu_s", decrypt.cpu},
+						{"peak_rss", decrypt.peakRss}, {"bytes_written", dirSize(dir.filePath("out"))}};
+					failures += ok ? 0 : 1;
+
+					// DataFiles of decrypted DDOC are decoded while writing new DDOC
+					QString again = dir.filePath("again.cdoc");
+					if(files > 1)
+					{
+						ok = false;
+						Usage reencrypt = measure([&] {
+							CDoc doc;
+							if(!doc.open(cdoc))
+								return;
+							CDocKey key = doc.keys().value(doc.findKey(recipients[0].der));
+							if(!doc.decrypt(key, [&](const CDocKey &k) { return agreement(pkey.get(), k); }) ||
+								!doc.encrypt(again))
+								return;
+							CDoc result;
+							ok = result.open(again) &&
+								result.decrypt(result.keys().value(result.findKey(recipients[0].der)),
+									[&](const CDocKey &k) { return agreement(pkey.get(), k); }) &&
+								sameFiles(result, QDir(dir.filePath("in")));
+						});
+						run["reencrypt"] = QJsonObject{{"ok", ok}, {"wall_s", reencrypt.wall}, {"cpu_s", reencrypt.cpu},
+							{"peak_rss", reencrypt.peakRss}, {"bytes_written", QFileInfo(again).size()}};
+						failures += ok ? 0 : 1;
+					}
+					results << run;
+
+					QDir(dir.filePath("in")).removeRecursively();
+					QDir(dir.filePath("out")).removeRecursively();
+					QFile::remove(cdoc);
+					QFile::remove(again);
+				}
+			}
+		}
+	}
+	printf("%s", QJsonDocument(results).toJson().constData());
+	return failures == 0 ? 0 : 1;
+}
@@ -26,12 +26,14 @@
 #include "QSigner.h"
 #include "SettingsDialog.h"
 
+#include "crypto/CryptoDoc.h"
 #include "crypto/MainWindow.h"
 
 #include <common/AboutDialog.h>
 #include <common/Configuration.h>
 #include <common/Settings.h>
 #include <common/SslCertificate.h>
+#include <common/TokenData.h>
 
 #include <digidocpp/Container.h>
 #include <digidocpp/XmlConf.h>
@@ -39,6 +41,8 @@
 
 #include "qtsingleapplication/src/qtlocalpeer.h"
 
+#include <QtCore/QDir>
+#include <QtCore/QFile>
 #include <QtCore/QFileInfo>
 #include <QtCore/QProcess>
 #include <QtCore/QJsonArray>
@@ -534,6 +538,84 @@ QVariant Application::confValue( ConfParameter parameter, const QVariant &value
 	return r.isEmpty() ? value.toString() : QString::fromUtf8( r );
 }
 
+void Application::decryptBatch( const QStringList &params, bool verify )
+{
+	// -crypto -decrypt [-out dir] file.cdoc|dir ...
+	// -crypto -verify [-report file] file.cdoc|dir ...
+	QStringList args = params;
+	auto option = [&]( const QString &name ) {
+		QString value;
+		int pos = args.indexOf( name );
+		if( pos >= 0 )
+		{
+			value = args.value( pos + 1 );
+			args.erase( args.begin() + pos, args.begin() + qMin( pos + 2, args.size() ) );
+		}
+		return value;
+	};
+	QString dir = option("-out");
+	QString report = option("-report");
+	QStringList files;
+	for( const QString &arg: args )
+	{
+		QFileInfo info( arg );
+		if( !info.isDir() )
+		{
+			files << arg;
+			continue;
+		}
+		QDir folder( arg );
+		for( const QString &file: folder.entryList( QStringList() << "*.cdoc", QDir::Files, QDir::Name ) )
+			files << folder.filePath( file );
+	}
+
+	// Token is read asynchronously after startup
+	if( d->signer->tokenauth().cert().isNull() )
+	{
+		QEventLoop e;
+		QTimer::singleShot( 30*1000, &e, SLOT(quit()) );
+		connect( d->signer, &QSigner::authDataChanged, &e, [&]( const TokenData &token ) {
+			if( !token.cert().isNull() )
+				e.quit();
+		});
+		e.exec();
+	}
+
+	if( !verify )
+	{
+		QStringList failed = CryptoDoc::decryptBatch( files, dir );
+		if( failed.isEmpty() )
+			QMessageBox::information( activeWindow(), tr("DigiDoc3 crypto"),
+				tr("Decrypted %n document(s)", "", files.size()) );
+		else
+			QMessageBox::warning( activeWindow(), tr("DigiDoc3 crypto"),
+				tr("Failed to decrypt documents:") + "<br />" + failed.join( "<br />" ) );
+		d->lastWindowTimer.start( 0 );
+		return;
+	}
+
+	// Report has line per document: OK or FAILED, path and error
+	QStringList errors = CryptoDoc::verifyBatch( files ), failed, lines;
+	for( int i = 0; i < files.size(); ++i )
+	{
+		QString error = errors.value( i ).replace( "<br />", " " );
+		lines << QString("%1\t%2\t%3").arg( error.isEmpty() ? "OK" : "FAILED", QDir::toNativeSeparators( files[i] ), error );
+		if( !error.isEmpty() )
+			failed << QString("%1: %2").arg( QDir::toNativeSeparators( files[i] ), error );
+	}
+	QFile f( report );
+	if( !report.isEmpty() && (!f.open( QFile::WriteOnly|QFile::Truncate ) ||
+			f.write( lines.join( "\n" ).toUtf8() + "\n" ) < 0) )
+		failed << tr("Failed to write report %1").arg( report );
+	if( failed.isEmpty() )
+		QMessageBox::information( activeWindow(), tr("DigiDoc3 crypto"),
+			tr("Verified %n document(s)", "", files.size()) );
+	else
+		QMessageBox::warning( activeWindow(), tr("DigiDoc3 crypto"),
+			tr("Failed to verify documents:") + "<br />" + failed.join( "<br />" ) );
+	d->lastWindowTimer.start( 0 );
+}
+
 void Application::diagnostics(QTextStream &s)
 {
 	s << "<br />TSL_URL: " << confValue(TSLUrl).toString()
@@ -729,6 +811,8 @@ void Application::parseArgs( const QStringList &args )
 	bool crypto = args.contains("-crypto");
 	QStringList params = args;
 	params.removeAll("-crypto");
+	bool decrypt = params.removeAll("-decrypt") > 0;
+	bool verify = params.removeAll("-verify") > 0;
 	params.removeAll("-capi");
 	params.removeAll("-cng");
 	params.removeAll("-pkcs11");
@@ -737,6 +821,8 @@ void Application::parseArgs( const QStringList &args )
 	QString suffix = QFileInfo( params.value( 0 ) ).suffix();
 	if( (QStringList() << "p12" << "p12d").contains( suffix, Qt::CaseInsensitive ) )
 		showSettings( SettingsDialog::AccessCertSettings, params[0] );
+	else if( crypto && (decrypt || verify) )
+		decryptBatch( params, verify );
 	else if( crypto || (QStringList() << "cdoc").contains( suffix, Qt::CaseInsensitive ) )
 		showCrypto( params );
 	else
@@ -94,6 +94,7 @@ Q_SIGNALS:
 
 private:
 	void activate( QWidget *w );
+	void decryptBatch( const QStringList &params, bool verify );
 	void diagnostics(QTextStream &s) override;
 	bool event( QEvent *e ) override;
 	static void showWarning(const QString &msg, const digidoc::Exception &e);
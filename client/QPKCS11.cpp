@@ -22,7 +22,7 @@
 #include <common/PinDialog.h>
 #include <common/QPCSC.h>
 #include <common/Settings.h>
-#include <crypto/CryptoDoc.h>
+#include <crypto/CDoc.h>
 
 #include <QtCore/QCryptographicHash>
 #include <QtCore/QDebug>
@@ -210,7 +210,7 @@ QByteArray QPKCS11::deriveConcatKDF(const QByteArray &publicKey, const QString &
 		hash = QCryptographicHash::Sha384;
 	if(digest == "http://www.w3.org/2001/04/xmlenc#sha512")
 		hash = QCryptographicHash::Sha512;
-	return CryptoDoc::concatKDF(hash, keySize, derive(publicKey), algorithmID + partyUInfo + partyVInfo);
+	return CDoc::concatKDF(hash, keySize, derive(publicKey), algorithmID + partyUInfo + partyVInfo);
 }
 
 QByteArray QPKCS11::decrypt( const QByteArray &data ) const
@@ -89,6 +89,21 @@ X509Cert QSigner::cert() const
 
 QSigner::ErrorCode QSigner::decrypt(const QByteArray &in, QByteArray &out, const QString &digest, int keySize,
 	const QByteArray &algorithmID, const QByteArray &partyUInfo, const QByteArray &partyVInfo)
+{
+	DecryptJob job;
+	job.in = in;
+	job.digest = digest;
+	job.keySize = keySize;
+	job.algorithmID = algorithmID;
+	job.partyUInfo = partyUInfo;
+	job.partyVInfo = partyVInfo;
+	QList<DecryptJob> jobs{job};
+	ErrorCode result = decrypt(jobs);
+	out = jobs[0].out;
+	return result;
+}
+
+QSigner::ErrorCode QSigner::decrypt(QList<DecryptJob> &jobs)
 {
 	if( d->count.loadAcquire() > 0 )
 	{
@@ -104,6 +119,7 @@ QSigner::ErrorCode QSigner::decrypt(const QByteArray &in, QByteArray &out, const
 		return DecryptFailed;
 	}
 
+	bool isRSA = d->auth.cert().publicKey().algorithm() == QSsl::Rsa;
 	if( d->pkcs11 )
 	{
 		QPKCS11::PinStatus status = d->pkcs11->login( d->auth );
@@ -131,33 +147,48 @@ QSigner::ErrorCode QSigner::decrypt(const QByteArray &in, QByteArray &out, const
 			Q_EMIT error( tr("Failed to login token") + " " + QPKCS11::errorString( status ) );
 			return DecryptFailed;
 		}
-		if(d->auth.cert().publicKey().algorithm() == QSsl::Rsa)
-			out = d->pkcs11->decrypt(in);
-		else
-			out = d->pkcs11->deriveConcatKDF(in, digest, keySize, algorithmID, partyUInfo, partyVInfo);
+		// Token operations are serialized in one session
+		for(DecryptJob &job: jobs)
+		{
+			if(isRSA)
+				job.out = d->pkcs11->decrypt(job.in);
+			else
+				job.out = d->pkcs11->deriveConcatKDF(job.in, job.digest, job.keySize,
+					job.algorithmID, job.partyUInfo, job.partyVInfo);
+		}
 		d->pkcs11->logout();
 	}
 #ifdef Q_OS_WIN
 	else if(d->win)
 	{
 		d->win->selectCert(d->auth.cert());
-		if(d->auth.cert().publicKey().algorithm() == QSsl::Rsa)
-			out = d->win->decrypt(in);
-		else
-			out = d->win->deriveConcatKDF(in, digest, keySize, algorithmID, partyUInfo, partyVInfo);
-		if(d->win->lastError() == QWin::PinCanceled)
+		for(DecryptJob &job: jobs)
 		{
-			d->count.deref();
-			return PinCanceled;
+			if(isRSA)
+				job.out = d->win->decrypt(job.in);
+			else
+				job.out = d->win->deriveConcatKDF(job.in, job.digest, job.keySize,
+					job.algorithmID, job.partyUInfo, job.partyVInfo);
+			if(d->win->lastError() == QWin::PinCanceled)
+			{
+				d->count.deref();
+				return PinCanceled;
+			}
 		}
 	}
 #endif
 
-	if( out.isEmpty() )
+	int failed = 0;
+	for(const DecryptJob &job: qAsConst(jobs))
+	{
+		if(job.out.isEmpty())
+			++failed;
+	}
+	if( failed > 0 )
 		Q_EMIT error( tr("Failed to decrypt document") );
 	d->count.deref();
 	reloadauth();
-	return !out.isEmpty() ? DecryptOK : DecryptFailed;
+	return failed < jobs.size() ? DecryptOK : DecryptFailed;
 }
 
 void QSigner::reloadauth() const
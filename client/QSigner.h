@@ -45,12 +45,21 @@ public:
 		DecryptFailed,
 		DecryptOK
 	};
+	struct DecryptJob
+	{
+		QByteArray in, out;
+		QString digest;
+		int keySize = 0;
+		QByteArray algorithmID, partyUInfo, partyVInfo;
+	};
 	explicit QSigner( ApiType api, QObject *parent = 0 );
 	~QSigner();
 
 	digidoc::X509Cert cert() const override;
 	ErrorCode decrypt(const QByteArray &in, QByteArray &out, const QString &digest, int keySize,
 		const QByteArray &algorithmID, const QByteArray &partyUInfo, const QByteArray &partyVInfo);
+	// Runs all jobs in one token session, failed jobs have empty out
+	ErrorCode decrypt(QList<DecryptJob> &jobs);
 	std::vector<unsigned char> sign( const std::string &method,
 		const std::vector<unsigned char> &digest ) const override;
 	TokenData tokenauth() const;
@@ -0,0 +1,376 @@
+/*
+ * QDigiDocCrypto
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include "Base64.h"
+
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define BASE64_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define BASE64_TARGET(X) __attribute__((target(X)))
+#else
+#define BASE64_TARGET(X)
+#endif
+
+typedef unsigned char uchar;
+// Decodes whole blocks of alphabet characters, returns number of characters consumed
+typedef size_t (*BlockDecoder)(const uchar *in, const uchar *end, char *out);
+// Encodes whole lines, returns number of bytes consumed
+typedef size_t (*LineEncoder)(const uchar *in, const uchar *end, char *out);
+
+static const char encodeTable[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static const signed char decodeTable[256] = {
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 62, -1, -1, -1, 63,
+	52, 53, 54, 55, 56, 57, 58, 59, 60, 61, -1, -1, -1, -1, -1, -1,
+	-1,  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14,
+	15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, -1, -1, -1, -1, -1,
+	-1, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40,
+	41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+};
+
+#ifdef BASE64_X86
+// Vector decoders map characters with nibble lookups (W. Mula, D. Lemire), a block
+// containing anything outside of alphabet is left to scalar code. Stores are wider
+// than decoded data, so two blocks of input must remain to keep stores inside
+// decodeSize() bounds.
+
+BASE64_TARGET("ssse3")
+static size_t decodeSSSE3(const uchar *in, const uchar *end, char *out)
+{
+	const __m128i shiftLUT = _mm_setr_epi8(0, 0, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+	const __m128i maskLUT = _mm_setr_epi8(char(0xa8), char(0xf8), char(0xf8), char(0xf8), char(0xf8), char(0xf8),
+		char(0xf8), char(0xf8), char(0xf8), char(0xf8), char(0xf0), 0x54, 0x50, 0x50, 0x50, 0x54);
+	const __m128i bitposLUT = _mm_setr_epi8(0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, char(0x80), 0, 0, 0, 0, 0, 0, 0, 0);
+	const __m128i nibble = _mm_set1_epi8(0x0f);
+	const __m128i slash = _mm_set1_epi8(0x2f);
+	const __m128i slashFix = _mm_set1_epi8(16 - 19);
+	const __m128i mergeBytes = _mm_set1_epi32(0x01400140);
+	const __m128i mergeWords = _mm_set1_epi32(0x00011000);
+	const __m128i pack = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+
+	const uchar *p = in;
+	for(; end - p >= 32; p += 16, out += 12)
+	{
+		__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+		__m128i hi = _mm_and_si128(_mm_srli_epi32(v, 4), nibble);
+		__m128i lo = _mm_and_si128(v, nibble);
+		__m128i valid = _mm_and_si128(_mm_shuffle_epi8(maskLUT, lo), _mm_shuffle_epi8(bitposLUT, hi));
+		if(_mm_movemask_epi8(_mm_cmpeq_epi8(valid, _mm_setzero_si128())))
+			break;
+		__m128i shift = _mm_add_epi8(_mm_shuffle_epi8(shiftLUT, hi), _mm_and_si128(_mm_cmpeq_epi8(v, slash), slashFix));
+		v = _mm_add_epi8(v, shift);
+		v = _mm_madd_epi16(_mm_maddubs_epi16(v, mergeBytes), mergeWords);
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(out), _mm_shuffle_epi8(v, pack));
+	}
+	return size_t(p - in);
+}
+
+BASE64_TARGET("avx2")
+static size_t decodeAVX2(const uchar *in, const uchar *end, char *out)
+{
+	const __m256i shiftLUT = _mm256_setr_epi8(
+		0, 0, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0,
+		0, 0, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+	const __m256i maskLUT = _mm256_setr_epi8(
+		char(0xa8), char(0xf8), char(0xf8), char(0xf8), char(0xf8), char(0xf8), char(0xf8), char(0xf8),
+		char(0xf8), char(0xf8), char(0xf0), 0x54, 0x50, 0x50, 0x50, 0x54,
+		char(0xa8), char(0xf8), char(0xf8), char(0xf8), char(0xf8), char(0xf8), char(0xf8), char(0xf8),
+		char(0xf8), char(0xf8), char(0xf0), 0x54, 0x50, 0x50, 0x50, 0x54);
+	const __m256i bitposLUT = _mm256_setr_epi8(
+		0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, char(0x80), 0, 0, 0, 0, 0, 0, 0, 0,
+		0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, char(0x80), 0, 0, 0, 0, 0, 0, 0, 0);
+	const __m256i nibble = _mm256_set1_epi8(0x0f);
+	const __m256i slash = _mm256_set1_epi8(0x2f);
+	const __m256i slashFix = _mm256_set1_epi8(16 - 19);
+	const __m256i mergeBytes = _mm256_set1_epi32(0x01400140);
+	const __m256i mergeWords = _mm256_set1_epi32(0x00011000);
+	const __m256i pack = _mm256_setr_epi8(
+		2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+		2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+	const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7);
+
+	const uchar *p = in;
+	for(; end - p >= 64; p += 32, out += 24)
+	{
+		__m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+		__m256i hi = _mm256_and_si256(_mm256_srli_epi32(v, 4), nibble);
+		__m256i lo = _mm256_and_si256(v, nibble);
+		__m256i valid = _mm256_and_si256(_mm256_shuffle_epi8(maskLUT, lo), _mm256_shuffle_epi8(bitposLUT, hi));
+		if(_mm256_movemask_epi8(_mm256_cmpeq_epi8(valid, _mm256_setzero_si256())))
+			break;
+		__m256i shift = _mm256_add_epi8(_mm256_shuffle_epi8(shiftLUT, hi), _mm256_and_si256(_mm256_cmpeq_epi8(v, slash), slashFix));
+		v = _mm256_add_epi8(v, shift);
+		v = _mm256_madd_epi16(_mm256_maddubs_epi16(v, mergeBytes), mergeWords);
+		v = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(v, pack), lanes);
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(out), v);
+	}
+	return size_t(p - in);
+}
+
+// Splits 12 bytes to 16 sextets and maps them to alphabet (W. Mula). Each line
+// reads 4 bytes past its end, so kernels stop when less than 52 bytes remain.
+
+BASE64_TARGET("ssse3")
+static inline __m128i encodeBlock(__m128i v)
+{
+	v = _mm_shuffle_epi8(v, _mm_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10));
+	__m128i hi = _mm_mulhi_epu16(_mm_and_si128(v, _mm_set1_epi32(0x0fc0fc00)), _mm_set1_epi32(0x04000040));
+	__m128i lo = _mm_mullo_epi16(_mm_and_si128(v, _mm_set1_epi32(0x003f03f0)), _mm_set1_epi32(0x01000010));
+	v = _mm_or_si128(hi, lo);
+	const __m128i shiftLUT = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+		'0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+	__m128i index = _mm_subs_epu8(v, _mm_set1_epi8(51));
+	index = _mm_or_si128(index, _mm_and_si128(_mm_cmpgt_epi8(_mm_set1_epi8(26), v), _mm_set1_epi8(13)));
+	return _mm_add_epi8(v, _mm_shuffle_epi8(shiftLUT, index));
+}
+
+BASE64_TARGET("ssse3")
+static size_t encodeSSSE3(const uchar *in, const uchar *end, char *out)
+{
+	const uchar *p = in;
+	for(; end - p >= 52; p += 48, out += 65)
+	{
+		for(int i = 0; i < 4; ++i)
+		{
+			__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i * 12));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(out + i * 16), encodeBlock(v));
+		}
+		out[64] = '\n';
+	}
+	return size_t(p - in);
+}
+
+BASE64_TARGET("avx2")
+static inline __m256i encodeBlock(__m256i v)
+{
+	v = _mm256_shuffle_epi8(v, _mm256_setr_epi8(
+		1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10,
+		1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10));
+	__m256i hi = _mm256_mulhi_epu16(_mm256_and_si256(v, _mm256_set1_epi32(0x0fc0fc00)), _mm256_set1_epi32(0x04000040));
+	__m256i lo = _mm256_mullo_epi16(_mm256_and_si256(v, _mm256_set1_epi32(0x003f03f0)), _mm256_set1_epi32(0x01000010));
+	v = _mm256_or_si256(hi, lo);
+	const __m256i shiftLUT = _mm256_setr_epi8(
+		'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+		'0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0,
+		'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+		'0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+	__m256i index = _mm256_subs_epu8(v, _mm256_set1_epi8(51));
+	index = _mm256_or_si256(index, _mm256_and_si256(_mm256_cmpgt_epi8(_mm256_set1_epi8(26), v), _mm256_set1_epi8(13)));
+	return _mm256_add_epi8(v, _mm256_shuffle_epi8(shiftLUT, index));
+}
+
+BASE64_TARGET("avx2")
+static size_t encodeAVX2(const uchar *in, const uchar *end, char *out)
+{
+	const uchar *p = in;
+	for(; end - p >= 52; p += 48, out += 65)
+	{
+		for(int i = 0; i < 2; ++i)
+		{
+			const uchar *block = p + i * 24;
+			__m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(
+				_mm_loadu_si128(reinterpret_cast<const __m128i*>(block))),
+				_mm_loadu_si128(reinterpret_cast<const __m128i*>(block + 12)), 1);
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i * 32), encodeBlock(v));
+		}
+		out[64] = '\n';
+	}
+	return size_t(p - in);
+}
+#endif
+
+static BlockDecoder blockDecoder(Base64::Implementation impl)
+{
+	switch(impl)
+	{
+#ifdef BASE64_X86
+	case Base64::AVX2: return decodeAVX2;
+	case Base64::SSSE3: return decodeSSSE3;
+#endif
+	default: return nullptr;
+	}
+}
+
+static LineEncoder lineEncoder(Base64::Implementation impl)
+{
+	switch(impl)
+	{
+#ifdef BASE64_X86
+	case Base64::AVX2: return encodeAVX2;
+	case Base64::SSSE3: return encodeSSSE3;
+#endif
+	default: return nullptr;
+	}
+}
+
+static Base64::Implementation detect()
+{
+	if(Base64::isSupported(Base64::AVX2))
+		return Base64::AVX2;
+	if(Base64::isSupported(Base64::SSSE3))
+		return Base64::SSSE3;
+	return Base64::Scalar;
+}
+
+static Base64::Implementation current = detect();
+static BlockDecoder kernel = blockDecoder(current);
+static LineEncoder encoder = lineEncoder(current);
+
+
+
+const size_t Base64::LINE;
+
+size_t Base64::decode( const char *in, size_t size, char *out, State &state )
+{
+	const uchar *p = reinterpret_cast<const uchar*>(in), *end = p + size;
+	char *o = out;
+	unsigned int buf = state.buf;
+	int nbits = state.nbits;
+	while(p < end)
+	{
+		// Vector path works only on quantum boundary
+		if(nbits == 0 && kernel)
+		{
+			size_t n = kernel(p, end, o);
+			p += n;
+			o += n / 4 * 3;
+			if(p == end)
+				break;
+		}
+		// Scalar until next quantum boundary, skips line breaks which stopped vector path
+		do
+		{
+			int d = decodeTable[*p++];
+			if(d < 0)
+				continue;
+			buf = (buf << 6) | unsigned(d);
+			nbits += 6;
+			if(nbits >= 8)
+			{
+				nbits -= 8;
+				*o++ = char(buf >> nbits);
+				buf &= (1u << nbits) - 1;
+			}
+		} while(p < end && nbits != 0);
+	}
+	state.buf = buf;
+	state.nbits = nbits;
+	return size_t(o - out);
+}
+
+size_t Base64::encode( const char *in, size_t size, char *out )
+{
+	const uchar *p = reinterpret_cast<const uchar*>(in), *end = p + size;
+	char *o = out;
+	if(encoder)
+	{
+		size_t n = encoder(p, end, o);
+		p += n;
+		o += n / LINE * 65;
+	}
+	while(p < end)
+	{
+		size_t len = std::min<size_t>(LINE, size_t(end - p));
+		for(; len >= 3; p += 3, len -= 3)
+		{
+			unsigned int v = unsigned(p[0]) << 16 | unsigned(p[1]) << 8 | p[2];
+			*o++ = encodeTable[(v >> 18) & 0x3F];
+			*o++ = encodeTable[(v >> 12) & 0x3F];
+			*o++ = encodeTable[(v >> 6) & 0x3F];
+			*o++ = encodeTable[v & 0x3F];
+		}
+		if(len > 0)
+		{
+			unsigned int v = unsigned(p[0]) << 16 | (len > 1 ? unsigned(p[1]) << 8 : 0);
+			*o++ = encodeTable[(v >> 18) & 0x3F];
+			*o++ = encodeTable[(v >> 12) & 0x3F];
+			*o++ = len > 1 ? encodeTable[(v >> 6) & 0x3F] : '=';
+			*o++ = '=';
+			p += len;
+		}
+		*o++ = '\n';
+	}
+	return size_t(o - out);
+}
+
+Base64::Implementation Base64::implementation()
+{
+	return current;
+}
+
+bool Base64::isSupported( Implementation impl )
+{
+	switch(impl)
+	{
+	case Scalar: return true;
+#if defined(BASE64_X86) && (defined(__GNUC__) || defined(__clang__))
+	case SSSE3: return __builtin_cpu_supports("ssse3");
+	case AVX2: return __builtin_cpu_supports("avx2");
+#elif defined(BASE64_X86) && defined(_MSC_VER)
+	case SSSE3:
+	{
+		int info[4];
+		__cpuid(info, 1);
+		return info[2] & (1 << 9);
+	}
+	case AVX2:
+	{
+		int info[4];
+		__cpuid(info, 0);
+		if(info[0] < 7)
+			return false;
+		__cpuid(info, 1);
+		// OSXSAVE and AVX, OS must save YMM registers
+		if((info[2] & (1 << 27)) == 0 || (info[2] & (1 << 28)) == 0 || (_xgetbv(0) & 6) != 6)
+			return false;
+		__cpuidex(info, 7, 0);
+		return info[1] & (1 << 5);
+	}
+#endif
+	default: return false;
+	}
+}
+
+bool Base64::setImplementation( Implementation impl )
+{
+	if(!isSupported(impl))
+		return false;
+	current = impl;
+	kernel = blockDecoder(impl);
+	encoder = lineEncoder(impl);
+	return true;
+}
@@ -0,0 +1,55 @@
+/*
+ * QDigiDocCrypto
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#pragma once
+
+#include <cstddef>
+
+// Base64 kernels on Latin-1 bytes, vector implementation is selected at runtime
+class Base64
+{
+public:
+	enum Implementation
+	{
+		Scalar,
+		SSSE3,
+		AVX2
+	};
+
+	// Bits of incomplete quantum carried between decode calls
+	struct State
+	{
+		unsigned int buf = 0;
+		int nbits = 0;
+	};
+
+	// Skips characters outside of alphabet (line breaks, padding), out must hold decodeSize(size) bytes
+	static size_t decode( const char *in, size_t size, char *out, State &state );
+	static size_t decodeSize( size_t size ) { return size / 4 * 3 + 3; }
+	// Wraps lines at 64 characters, every line including last one ends with '\n'
+	static size_t encode( const char *in, size_t size, char *out );
+	static size_t encodeSize( size_t size ) { return (size + LINE - 1) / LINE * 65; }
+
+	// Input bytes per encoded line
+	static const size_t LINE = 48;
+
+	static Implementation implementation();
+	static bool setImplementation( Implementation impl );
+	static bool isSupported( Implementation impl );
+};
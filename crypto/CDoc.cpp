@@ -0,0 +1,1579 @@
+/*
+ * QDigiDocCrypto
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include "CDoc.h"
+
+#include "Base64.h"
+#include "StreamFilter.h"
+#include "TempFile.h"
+
+#include <QtCore/QCache>
+#include <QtCore/QCryptographicHash>
+#include <QtCore/QFileInfo>
+#include <QtCore/QLoggingCategory>
+#include <QtCore/QMap>
+#include <QtCore/QMutex>
+#include <QtCore/QRunnable>
+#include <QtCore/QSaveFile>
+#include <QtCore/QThreadPool>
+#include <QtCore/QtEndian>
+#include <QtCore/QXmlStreamReader>
+#include <QtCore/QXmlStreamWriter>
+
+#include <openssl/aes.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/rsa.h>
+#include <openssl/ecdh.h>
+#include <openssl/x509.h>
+
+#include <zlib.h>
+
+#include <cctype>
+#include <cmath>
+#include <memory>
+#include <utility>
+
+typedef uchar *puchar;
+typedef const uchar *pcuchar;
+
+#define SCOPE(TYPE, VAR, DATA) std::unique_ptr<TYPE,decltype(&TYPE##_free)> VAR(DATA, TYPE##_free)
+
+Q_LOGGING_CATEGORY(CRYPTO,"CRYPTO")
+
+// Recipient certificate forms used by writeCDoc, cached by certificate digest
+struct CKeyMaterial
+{
+	QByteArray der, base64, partyVInfo, oid;
+	std::shared_ptr<EVP_PKEY> publicKey;
+	int curve = NID_undef;
+
+	static std::shared_ptr<const CKeyMaterial> get(const QByteArray &der);
+};
+
+// Ephemeral ECDH keys of writeCDoc, generated on background thread while recipients are added.
+// Pool is bounded per curve and every key is handed out once.
+struct EphemeralKeys
+{
+	static const int MAX = 64;
+
+	static EphemeralKeys &instance();
+	static std::shared_ptr<EVP_PKEY> generate(int curve);
+	// Keeps count keys of curve ready, at most MAX
+	void reserve(int curve, int count);
+	// Pooled key or new key when pool is empty
+	std::shared_ptr<EVP_PKEY> take(int curve);
+
+private:
+	void fill();
+
+	QMutex mutex;
+	QHash<int,int> wanted;
+	QHash<int,QList<std::shared_ptr<EVP_PKEY>>> ready;
+	bool running = false;
+};
+
+// DER element at p, contents are [data, end)
+struct DERElement
+{
+	pcuchar begin = nullptr, data = nullptr, end = nullptr;
+
+	bool read(pcuchar p, pcuchar limit)
+	{
+		if(limit - p < 2)
+			return false;
+		begin = p++;
+		size_t len = *p++;
+		if(len & 0x80)
+		{
+			int n = len & 0x7F;
+			if(n == 0 || n > 4 || limit - p < n)
+				return false;
+			for(len = 0; n > 0; --n)
+				len = len << 8 | *p++;
+		}
+		if(size_t(limit - p) < len)
+			return false;
+		data = p;
+		end = p + len;
+		return true;
+	}
+	QByteArray toByteArray() const { return QByteArray(reinterpret_cast<const char*>(begin), int(end - begin)); }
+};
+
+// Issuer name and serial number of certificate without decoding it, empty when malformed
+static QByteArray issuerSerial(const QByteArray &der)
+{
+	DERElement cert, tbs, serial, algorithm, issuer;
+	pcuchar p = pcuchar(der.constData());
+	if(!cert.read(p, p + der.size()) || *cert.begin != 0x30 ||
+			!tbs.read(cert.data, cert.end) || *tbs.begin != 0x30 ||
+			!serial.read(tbs.data, tbs.end))
+		return QByteArray();
+	// Optional explicit [0] version
+	if(*serial.begin == 0xA0 && !serial.read(serial.end, tbs.end))
+		return QByteArray();
+	if(*serial.begin != 0x02 ||
+			!algorithm.read(serial.end, tbs.end) ||
+			!issuer.read(algorithm.end, tbs.end) || *issuer.begin != 0x30)
+		return QByteArray();
+	return issuer.toByteArray() + serial.toByteArray();
+}
+
+static inline void writeAttributes(QXmlStreamWriter &x, const QMap<QString,QString> &attrs)
+{
+	for(QMap<QString,QString>::const_iterator i = attrs.cbegin(), end = attrs.cend(); i != end; ++i)
+		x.writeAttribute(i.key(), i.value());
+}
+
+static inline void writeElement(QXmlStreamWriter &x, const QString &ns, const QString &name, const std::function<void()> &f = nullptr)
+{
+	x.writeStartElement(ns, name);
+	if(f)
+		f();
+	x.writeEndElement();
+}
+
+static inline void writeElement(QXmlStreamWriter &x, const QString &ns, const QString &name, const QMap<QString,QString> &attrs, const std::function<void()> &f = nullptr)
+{
+	x.writeStartElement(ns, name);
+	writeAttributes(x, attrs);
+	if(f)
+		f();
+	x.writeEndElement();
+}
+
+static inline bool writeBase64(QXmlStreamWriter &x, const char *data, qint64 size, QByteArray &buf)
+{
+	// Alphabet needs no escaping, encoded lines go directly to device
+	x.writeCharacters(QString());
+	const qint64 block = StreamFilter::CHUNK / 65 * qint64(Base64::LINE);
+	for(qint64 i = 0; i < size; i += block)
+	{
+		qint64 len = qMin(size - i, block);
+		buf.resize(int(Base64::encodeSize(size_t(len))));
+		qint64 out = qint64(Base64::encode(data + i, size_t(len), buf.data()));
+		if(x.device()->write(buf.constData(), out) != out)
+			return false;
+	}
+	return true;
+}
+
+static inline bool writeBase64(QXmlStreamWriter &x, const QByteArray &data)
+{
+	QByteArray buf;
+	return writeBase64(x, data.constData(), data.size(), buf);
+}
+
+static inline void writeEncodedElement(QXmlStreamWriter &x, const QString &ns, const QString &name, const QByteArray &base64)
+{
+	x.writeStartElement(ns, name);
+	x.writeCharacters(QString());
+	x.device()->write(base64);
+	x.writeEndElement();
+}
+
+static inline void writeBase64Element(QXmlStreamWriter &x, const QString &ns, const QString &name, const QByteArray &data)
+{
+	x.writeStartElement(ns, name);
+	writeBase64(x, data);
+	x.writeEndElement();
+}
+
+const QString CDoc::MIME_XML = "text/xml";
+const QString CDoc::MIME_ZLIB = "http://www.isi.edu/in-noes/iana/assignments/media-types/application/zip";
+const QString CDoc::MIME_DDOC = "http://www.sk.ee/DigiDoc/v1.3.0/digidoc.xsd";
+const QString CDoc::MIME_DDOC_OLD = "http://www.sk.ee/DigiDoc/1.3.0/digidoc.xsd";
+const QString CDoc::DS = "http://www.w3.org/2000/09/xmldsig#";
+const QString CDoc::DENC = "http://www.w3.org/2001/04/xmlenc#";
+const QString CDoc::DSIG11 = "http://www.w3.org/2009/xmldsig11#";
+const QString CDoc::XENC11 = "http://www.w3.org/2009/xmlenc11#";
+
+const QString CDoc::AES128CBC_MTH = "http://www.w3.org/2001/04/xmlenc#aes128-cbc";
+const QString CDoc::AES192CBC_MTH = "http://www.w3.org/2001/04/xmlenc#aes192-cbc";
+const QString CDoc::AES256CBC_MTH = "http://www.w3.org/2001/04/xmlenc#aes256-cbc";
+const QString CDoc::AES128GCM_MTH = "http://www.w3.org/2009/xmlenc11#aes128-gcm";
+const QString CDoc::AES192GCM_MTH = "http://www.w3.org/2009/xmlenc11#aes192-gcm";
+const QString CDoc::AES256GCM_MTH = "http://www.w3.org/2009/xmlenc11#aes256-gcm";
+const QString CDoc::RSA_MTH = "http://www.w3.org/2001/04/xmlenc#rsa-1_5";
+const QString CDoc::KWAES128_MTH = "http://www.w3.org/2001/04/xmlenc#kw-aes128";
+const QString CDoc::KWAES192_MTH = "http://www.w3.org/2001/04/xmlenc#kw-aes192";
+const QString CDoc::KWAES256_MTH = "http://www.w3.org/2001/04/xmlenc#kw-aes256";
+const QString CDoc::CONCATKDF_MTH = "http://www.w3.org/2009/xmlenc11#ConcatKDF";
+const QString CDoc::AGREEMENT_MTH = "http://www.w3.org/2009/xmlenc11#ECDH-ES";
+const QString CDoc::SHA256_MTH = "http://www.w3.org/2001/04/xmlenc#sha256";
+const QString CDoc::SHA384_MTH = "http://www.w3.org/2001/04/xmlenc#sha384";
+const QString CDoc::SHA512_MTH = "http://www.w3.org/2001/04/xmlenc#sha512";
+
+static const QHash<QString, const EVP_CIPHER*> ENC_MTH{
+	{CDoc::AES128CBC_MTH, EVP_aes_128_cbc()}, {CDoc::AES192CBC_MTH, EVP_aes_192_cbc()}, {CDoc::AES256CBC_MTH, EVP_aes_256_cbc()},
+	{CDoc::AES128GCM_MTH, EVP_aes_128_gcm()}, {CDoc::AES192GCM_MTH, EVP_aes_192_gcm()}, {CDoc::AES256GCM_MTH, EVP_aes_256_gcm()},
+};
+const QHash<QString, QCryptographicHash::Algorithm> CDoc::SHA_MTH{
+	{SHA256_MTH, QCryptographicHash::Sha256}, {SHA384_MTH, QCryptographicHash::Sha384}, {SHA512_MTH, QCryptographicHash::Sha512}
+};
+const QHash<QString, quint32> CDoc::KWAES_SIZE{{KWAES128_MTH, 16}, {KWAES192_MTH, 24}, {KWAES256_MTH, 32}};
+
+qint64 CDoc::File::length() const
+{
+	if(offset >= 0)
+		return decodedSize;
+	return path.isEmpty() ? data.size() : QFileInfo(path).size();
+}
+
+bool CDoc::File::read(const std::function<bool (const char *data, qint64 size)> &f) const
+{
+	if(path.isEmpty())
+		return data.isEmpty() || f(data.constData(), data.size());
+	QFile file(path);
+	if(!file.open(QFile::ReadOnly))
+		return false;
+	if(offset >= 0)
+	{
+		FunctionSink sink(f);
+		FilterChain chain(&sink);
+		chain.append(new Base64Decoder(chain.head()));
+		return readRange(file, offset, offset + encodedSize, [&](const char *data, qint64 size) {
+			return chain.write(data, size);
+		}) && chain.finish();
+	}
+	return readRange(file, 0, file.size(), f);
+}
+
+bool CDoc::File::save(const QString &dst) const
+{
+	if(offset < 0 && !path.isEmpty())
+		return QFile::copy(path, dst);
+	QFile file(dst);
+	return file.open(QFile::WriteOnly) && read([&](const char *data, qint64 size) {
+		return file.write(data, size) == size;
+	});
+}
+
+bool CDoc::File::readRange(QFile &file, qint64 begin, qint64 end,
+	const std::function<bool (const char *data, qint64 size)> &f)
+{
+	// Map file in windows to bound address space, window is multiple of base64 line length
+	const qint64 window = qint64(Base64::LINE) * 256 * 1024;
+	QByteArray buf;
+	for(qint64 pos = begin; pos < end; pos += window)
+	{
+		qint64 len = qMin(window, end - pos);
+		if(uchar *map = file.map(pos, len))
+		{
+			bool result = f(reinterpret_cast<const char*>(map), len);
+			file.unmap(map);
+			if(!result)
+				return false;
+			continue;
+		}
+		buf.resize(int(len));
+		if(!file.seek(pos) || file.read(buf.data(), len) != len || !f(buf.constData(), len))
+			return false;
+	}
+	return true;
+}
+
+QByteArray CDoc::AES_wrap(const QByteArray &key, const QByteArray &data, bool encrypt)
+{
+	QByteArray result;
+	AES_KEY aes;
+	if(0 != (encrypt ?
+		AES_set_encrypt_key(pcuchar(key.data()), key.length() * 8, &aes) :
+		AES_set_decrypt_key(pcuchar(key.data()), key.length() * 8, &aes)))
+		return result;
+	result.resize(data.size() + 8);
+	int size = encrypt ?
+		AES_wrap_key(&aes, nullptr, puchar(result.data()), pcuchar(data.data()), uint(data.size())) :
+		AES_unwrap_key(&aes, nullptr, puchar(result.data()), pcuchar(data.data()), uint(data.size()));
+	if(size > 0)
+		result.resize(size);
+	else
+		result.clear();
+	return result;
+}
+
+bool CDoc::decryptPayload(QIODevice *cdoc, QIODevice *out)
+{
+	if(!ENC_MTH.contains(method))
+	{
+		lastError = tr("Error parsing document");
+		return false;
+	}
+
+	// base64 -> AES -> ANSIX923 padding -> zlib -> out
+	FilterChain chain(out);
+	if(mime == MIME_ZLIB)
+		chain.append(new InflateFilter(chain.head()));
+	if(method == AES128CBC_MTH)
+		chain.append(new PaddingFilter(false, chain.head()));
+	// Large payloads are read in batches for decoding and decryption on all cores
+	bool parallel = payloadEnd - payloadBegin >= StreamFilter::PARALLEL;
+	qint64 segment = properties.value("PayloadSegmentSize").toLongLong();
+	if(segment > 0)
+		chain.append(new SegmentFilter(ENC_MTH[method], key, false, segment, chain.head()));
+	else
+	{
+		CipherFilter *cipher = new CipherFilter(ENC_MTH[method], key, false, chain.head());
+		cipher->setParallel(parallel);
+		chain.append(cipher);
+	}
+	chain.append(new Base64Decoder(chain.head()));
+
+	QByteArray buf(int(parallel ? StreamFilter::PARALLEL : StreamFilter::CHUNK), Qt::Uninitialized);
+	bool result = cdoc->seek(payloadBegin);
+	for(qint64 left = payloadEnd - payloadBegin; result && left > 0;)
+	{
+		qint64 size = cdoc->read(buf.data(), qMin<qint64>(left, buf.size()));
+		result = size > 0 && chain.write(buf.constData(), size) && progressed(size);
+		left -= size;
+	}
+	if(result && chain.finish())
+		return true;
+	qCWarning(CRYPTO) << "Failed to decrypt payload" << chain.head()->errorString();
+	lastError = tr("Failed to decrypt document");
+	return false;
+}
+
+bool CDoc::encryptPayload(QIODevice *cdoc, bool ddoc)
+{
+	// files -> DDOC -> zlib -> ANSIX923 padding -> AES -> base64 -> cdoc
+	FilterChain chain(cdoc);
+	chain.append(new Base64Encoder(chain.head()));
+	if(segment > 0)
+		chain.append(new SegmentFilter(ENC_MTH[method], key, true, segment, chain.head()));
+	else
+		chain.append(new CipherFilter(ENC_MTH[method], key, true, chain.head()));
+	if(method == AES128CBC_MTH)
+		chain.append(new PaddingFilter(true, chain.head()));
+	DeflateFilter *deflate = nullptr;
+	if(compressed)
+		chain.append(deflate = new DeflateFilter(Z_DEFAULT_COMPRESSION, chain.head()));
+
+	bool result = true;
+	if(ddoc)
+		result = writeDDoc(chain.head());
+	else
+		result = files[0].read([&](const char *data, qint64 size) { return chain.write(data, size) && progressed(size); });
+	if(deflate)
+		originalSize = deflate->total();
+	if(result && chain.finish())
+		return true;
+	qCWarning(CRYPTO) << "Failed to encrypt payload" << chain.head()->errorString();
+	lastError = tr("Failed to encrypt document");
+	return false;
+}
+
+// Follows element path with byte level tag scanner, element content is skipped with memchr.
+// f gets path including element, start tag without brackets and range of text up to next tag,
+// returning false stops scan. Returns true when stopped by f.
+static bool scanXml(QIODevice *dev, const std::function<bool (const QList<QByteArray> &path, const QByteArray &tag, qint64 begin, qint64 end)> &f)
+{
+	QList<QByteArray> path;
+	QByteArray tag, open;
+	qint64 openEnd = -1;
+	bool inTag = false;
+	char quote = 0;
+	auto scan = [&](const char *data, qint64 size, qint64 pos) {
+		for(const char *p = data, *end = p + size; p < end; ++p)
+		{
+			if(!inTag)
+			{
+				if(!(p = static_cast<const char*>(memchr(p, '<', size_t(end - p)))))
+					break;
+				if(openEnd >= 0 && !f(path, open, openEnd, pos + (p - data)))
+					return true;
+				openEnd = -1;
+				inTag = true;
+				tag.clear();
+				continue;
+			}
+			if(*p != '>' || quote)
+			{
+				if(quote == *p)
+					quote = 0;
+				else if(!quote && (*p == '"' || *p == '\''))
+					quote = *p;
+				tag += *p;
+				continue;
+			}
+
+			inTag = false;
+			if(tag.startsWith('?') || tag.startsWith('!'))
+				continue;
+			if(tag.startsWith('/'))
+			{
+				if(!path.isEmpty())
+					path.removeLast();
+				continue;
+			}
+			int nameEnd = 0;
+			while(nameEnd < tag.size() && tag[nameEnd] != '/' && !isspace(uchar(tag[nameEnd])))
+				++nameEnd;
+			QByteArray name = tag.left(nameEnd);
+			path << name.mid(name.indexOf(':') + 1);
+			if(tag.endsWith('/'))
+			{
+				bool next = f(path, tag, pos + (p - data) + 1, pos + (p - data) + 1);
+				path.removeLast();
+				if(!next)
+					return true;
+				continue;
+			}
+			open = tag;
+			openEnd = pos + (p - data) + 1;
+		}
+		return false;
+	};
+
+	// Map whole file when address space allows, otherwise scan in chunks
+	QFileDevice *file = qobject_cast<QFileDevice*>(dev);
+	if(uchar *map = file && file->size() > 0 ? file->map(0, file->size()) : nullptr)
+	{
+		bool result = scan(reinterpret_cast<const char*>(map), file->size(), 0);
+		file->unmap(map);
+		return result;
+	}
+	if(!dev->seek(0))
+		return false;
+	QByteArray buf(int(StreamFilter::CHUNK), Qt::Uninitialized);
+	qint64 size = 0;
+	for(qint64 pos = 0; (size = dev->read(buf.data(), buf.size())) > 0; pos += size)
+	{
+		if(scan(buf.constData(), size, pos))
+			return true;
+	}
+	return false;
+}
+
+bool CDoc::findPayload(QIODevice *cdoc)
+{
+	payloadBegin = payloadEnd = -1;
+	return scanXml(cdoc, [&](const QList<QByteArray> &path, const QByteArray &, qint64 begin, qint64 end) {
+		if(path.size() != 3 || path[0] != "EncryptedData" || path[1] != "CipherData" || path[2] != "CipherValue")
+			return true;
+		payloadBegin = begin;
+		payloadEnd = end;
+		return false;
+	});
+}
+
+QByteArray CDoc::fromBase64( const QStringRef &data )
+{
+	QByteArray latin = data.toLatin1();
+	QByteArray result(int(Base64::decodeSize(size_t(latin.size()))), Qt::Uninitialized);
+	Base64::State state;
+	result.truncate(int(Base64::decode(latin.constData(), size_t(latin.size()), result.data(), state)));
+	return result;
+}
+
+void CDoc::indexKey(int id)
+{
+	// First recipient wins when certificate is listed more than once
+	const QByteArray &der = recipientKeys.at(id).der;
+	QByteArray digest = QCryptographicHash::hash(der, QCryptographicHash::Sha256);
+	if(!digestIndex.contains(digest))
+		digestIndex.insert(digest, id);
+	QByteArray name = issuerSerial(der);
+	if(!name.isEmpty() && !issuerSerialIndex.contains(name))
+		issuerSerialIndex.insert(name, id);
+}
+
+bool CDoc::isCompressible() const
+{
+	// Deflate start of every file with fastest level, already compressed formats do not shrink
+	const int sampleSize = 64 * 1024;
+	qint64 in = 0, out = 0;
+	for(const File &file: files)
+	{
+		QByteArray sample;
+		file.read([&](const char *data, qint64 size) {
+			sample.append(data, int(qMin<qint64>(size, sampleSize - sample.size())));
+			return sample.size() < sampleSize;
+		});
+		uLongf size = compressBound(uLong(sample.size()));
+		QByteArray result(int(size), Qt::Uninitialized);
+		if(compress2(puchar(result.data()), &size, pcuchar(sample.constData()), uLong(sample.size()), Z_BEST_SPEED) != Z_OK)
+			return false;
+		in += sample.size();
+		out += qint64(size);
+	}
+	qCDebug(CRYPTO) << "Compression sample" << in << "->" << out;
+	return in > 0 && out * 10 < in * 9;
+}
+
+bool CDoc::opensslError(bool err)
+{
+	if(err)
+	{
+		unsigned long errorCode = 0;
+		while((errorCode =  ERR_get_error()) != 0)
+			qCWarning(CRYPTO) << ERR_error_string(errorCode, 0);
+	}
+	return err;
+}
+
+void CDoc::readCDoc(QIODevice *cdoc)
+{
+	qCDebug(CRYPTO) << "Parsing CDOC file";
+	// Parse only header and trailer, payload range is kept for decryption
+	QXmlStreamReader xml;
+	if(findPayload(cdoc) && cdoc->seek(0))
+	{
+		qCDebug(CRYPTO) << "Payload range" << payloadBegin << payloadEnd;
+		QByteArray skeleton = cdoc->read(payloadBegin);
+		if(cdoc->seek(payloadEnd))
+			skeleton += cdoc->readAll();
+		xml.addData(skeleton);
+	}
+	else
+	{
+		qCWarning(CRYPTO) << "Payload not found, parsing whole file";
+		cdoc->seek(0);
+		xml.setDevice(cdoc);
+	}
+
+	files.clear();
+	recipientKeys.clear();
+	digestIndex.clear();
+	issuerSerialIndex.clear();
+	properties.clear();
+	method.clear();
+	mime.clear();
+	while( !xml.atEnd() )
+	{
+		if( !xml.readNextStartElement() )
+			continue;
+		// EncryptedData
+		if( xml.name() == "EncryptedData")
+			mime = xml.attributes().value("MimeType").toString();
+		// EncryptedData/EncryptionProperties/EncryptionProperty
+		else if( xml.name() == "EncryptionProperty" )
+		{
+			for( const QXmlStreamAttribute &attr: xml.attributes() )
+			{
+				if( attr.name() != "Name" )
+					continue;
+				if( attr.value() == "orig_file" )
+				{
+					QStringList fileparts = xml.readElementText().split("|");
+					File file;
+					file.name = fileparts.value(0);
+					file.size = fileparts.value(1);
+					file.mime = fileparts.value(2);
+					file.id = fileparts.value(3);
+					files << file;
+				}
+				else
+					properties[attr.value().toString()] = xml.readElementText();
+			}
+		}
+		// EncryptedData/EncryptionMethod
+		else if( xml.name() == "EncryptionMethod" )
+			method = xml.attributes().value("Algorithm").toString();
+		// EncryptedData/KeyInfo/EncryptedKey
+		else if( xml.name() == "EncryptedKey" )
+		{
+			CDocKey key;
+			key.id = xml.attributes().value("Id").toString();
+			key.recipient = xml.attributes().value("Recipient").toString();
+			while(!xml.atEnd())
+			{
+				xml.readNext();
+				if( xml.name() == "EncryptedKey" && xml.isEndElement() )
+					break;
+				if( !xml.isStartElement() )
+					continue;
+				// EncryptedData/KeyInfo/KeyName
+				if(xml.name() == "KeyName")
+					key.name = xml.readElementText();
+				// EncryptedData/KeyInfo/EncryptedKey/EncryptionMethod
+				else if(xml.name() == "EncryptionMethod")
+					key.method = xml.attributes().value("Algorithm").toString();
+				// EncryptedData/KeyInfo/EncryptedKey/KeyInfo/AgreementMethod
+				else if(xml.name() == "AgreementMethod")
+					key.agreement = xml.attributes().value("Algorithm").toString();
+				// EncryptedData/KeyInfo/EncryptedKey/KeyInfo/AgreementMethod/KeyDerivationMethod
+				else if(xml.name() == "KeyDerivationMethod")
+					key.derive = xml.attributes().value("Algorithm").toString();
+				// EncryptedData/KeyInfo/EncryptedKey/KeyInfo/AgreementMethod/KeyDerivationMethod/ConcatKDFParams
+				else if(xml.name() == "ConcatKDFParams")
+				{
+					key.AlgorithmID = QByteArray::fromHex(xml.attributes().value("AlgorithmID").toUtf8());
+					if(key.AlgorithmID[0] == char(0x00)) key.AlgorithmID.remove(0, 1);
+					key.PartyUInfo = QByteArray::fromHex(xml.attributes().value("PartyUInfo").toUtf8());
+					if(key.PartyUInfo[0] == char(0x00)) key.PartyUInfo.remove(0, 1);
+					key.PartyVInfo = QByteArray::fromHex(xml.attributes().value("PartyVInfo").toUtf8());
+					if(key.PartyVInfo[0] == char(0x00)) key.PartyVInfo.remove(0, 1);
+				}
+				// EncryptedData/KeyInfo/EncryptedKey/KeyInfo/AgreementMethod/KeyDerivationMethod/ConcatKDFParams/DigestMethod
+				else if(xml.name() == "DigestMethod")
+					key.concatDigest = xml.attributes().value("Algorithm").toString();
+				// EncryptedData/KeyInfo/EncryptedKey/KeyInfo/AgreementMethod/OriginatorKeyInfo/KeyValue/ECKeyValue/PublicKey
+				else if(xml.name() == "PublicKey")
+				{
+					xml.readNext();
+					key.publicKey = fromBase64(xml.text());
+				}
+				// EncryptedData/KeyInfo/EncryptedKey/KeyInfo/X509Data/X509Certificate
+				else if(xml.name() == "X509Certificate")
+				{
+					xml.readNext();
+					key.der = fromBase64(xml.text());
+				}
+				// EncryptedData/KeyInfo/EncryptedKey/KeyInfo/CipherData/CipherValue
+				else if(xml.name() == "CipherValue")
+				{
+					xml.readNext();
+					key.cipher = fromBase64(xml.text());
+				}
+			}
+			recipientKeys << key;
+			indexKey(recipientKeys.size() - 1);
+		}
+	}
+}
+
+bool CDoc::writeCDoc(QIODevice *cdoc, const QByteArray &transportKey, QMultiHash<QString,QString> props,
+	const std::function<bool (QIODevice *cdoc)> &payload, const QString &mime)
+{
+#ifndef NDEBUG
+	qDebug() << "ENC Transport Key" << transportKey.toHex();
+#endif
+
+	qCDebug(CRYPTO) << "Writing CDOC file" << props.value("DocumentFormat") << "mime" << mime;
+	// Key agreement and wrapping is independent per recipient, compute on all cores and serialize in order
+	struct Wrapped
+	{
+		QByteArray cipher, SsDer;
+		QString concatDigest;
+		bool ok = false;
+	};
+	std::vector<Wrapped> wrapped(size_t(recipientKeys.size()));
+	const QByteArray documentFormat = props.value("DocumentFormat").toUtf8();
+	// Keys read from existing document are not resolved by setCert()
+	for(CDocKey &k: recipientKeys)
+	{
+		if(!k.material)
+			k.material = CKeyMaterial::get(k.der);
+		if(!k.material)
+			return false;
+	}
+	parallelFor(recipientKeys.size(), [&](int i) {
+		const CKeyMaterial &m = *recipientKeys.at(i).material;
+		Wrapped &r = wrapped[size_t(i)];
+		if (EVP_PKEY_base_id(m.publicKey.get()) == EVP_PKEY_RSA)
+		{
+			SCOPE(RSA, rsa, EVP_PKEY_get1_RSA(m.publicKey.get()));
+			r.cipher.resize(RSA_size(rsa.get()));
+			r.ok = !opensslError(RSA_public_encrypt(transportKey.size(), pcuchar(transportKey.constData()),
+				puchar(r.cipher.data()), rsa.get(), RSA_PKCS1_PADDING) <= 0);
+			return;
+		}
+
+		std::shared_ptr<EVP_PKEY> pkey = EphemeralKeys::instance().take(m.curve);
+		if (opensslError(!pkey))
+			return;
+		SCOPE(EVP_PKEY_CTX, ctx, EVP_PKEY_CTX_new(pkey.get(), nullptr));
+		size_t sharedSecretLen = 0;
+		if (opensslError(!ctx) ||
+			opensslError(EVP_PKEY_derive_init(ctx.get()) <= 0) ||
+			opensslError(EVP_PKEY_derive_set_peer(ctx.get(), m.publicKey.get()) <= 0) ||
+			opensslError(EVP_PKEY_derive(ctx.get(), nullptr, &sharedSecretLen) <= 0))
+			return;
+		QByteArray sharedSecret(int(sharedSecretLen), 0);
+		if(opensslError(EVP_PKEY_derive(ctx.get(), puchar(sharedSecret.data()), &sharedSecretLen) <= 0))
+			return;
+
+		r.SsDer.resize(i2d_PublicKey(pkey.get(), nullptr));
+		puchar p = puchar(r.SsDer.data());
+		i2d_PublicKey(pkey.get(), &p);
+
+		switch((r.SsDer.size() - 1) / 2) {
+		case 32: r.concatDigest = SHA256_MTH; break;
+		case 48: r.concatDigest = SHA384_MTH; break;
+		default: r.concatDigest = SHA512_MTH; break;
+		}
+		QByteArray encryptionKey = concatKDF(SHA_MTH[r.concatDigest], KWAES_SIZE[KWAES256_MTH],
+			sharedSecret, documentFormat + r.SsDer + m.der);
+#ifndef NDEBUG
+		qDebug() << "ENC Ss" << r.SsDer.toHex();
+		qDebug() << "ENC Ksr" << sharedSecret.toHex();
+		qDebug() << "ENC ConcatKDF" << encryptionKey.toHex();
+#endif
+
+		r.cipher = AES_wrap(encryptionKey, transportKey, true);
+		r.ok = !opensslError(r.cipher.isEmpty());
+	});
+	for(const Wrapped &r: wrapped)
+	{
+		if(!r.ok)
+			return false;
+	}
+
+	bool result = true;
+	QXmlStreamWriter w(cdoc);
+	w.setAutoFormatting(true);
+	w.writeStartDocument();
+	w.writeNamespace(DENC, "denc");
+	writeElement(w, DENC, "EncryptedData", [&]{
+		if(compressed)
+			w.writeAttribute("MimeType", MIME_ZLIB);
+		else if(!mime.isEmpty())
+			w.writeAttribute("MimeType", mime);
+		writeElement(w, DENC, "EncryptionMethod", {{"Algorithm", method}});
+		w.writeNamespace(DS, "ds");
+		writeElement(w, DS, "KeyInfo", [&]{
+		for(int i = 0; i < recipientKeys.size(); ++i)
+		{
+			const CDocKey &k = recipientKeys.at(i);
+			const CKeyMaterial &m = *k.material;
+			const Wrapped &r = wrapped[size_t(i)];
+			writeElement(w, DENC, "EncryptedKey", [&]{
+				if(!k.id.isEmpty())
+					w.writeAttribute("Id", k.id);
+				if(!k.recipient.isEmpty())
+					w.writeAttribute("Recipient", k.recipient);
+				if (r.SsDer.isEmpty())
+				{
+					writeElement(w, DENC, "EncryptionMethod", {{"Algorithm", RSA_MTH}});
+					writeElement(w, DS, "KeyInfo", [&]{
+						if(!k.name.isEmpty())
+							w.writeTextElement(DS, "KeyName", k.name);
+						writeElement(w, DS, "X509Data", [&]{
+							writeEncodedElement(w, DS, "X509Certificate", m.base64);
+						});
+					});
+				}
+				else
+				{
+					writeElement(w, DENC, "EncryptionMethod", {{"Algorithm", KWAES256_MTH}});
+					writeElement(w, DS, "KeyInfo", [&]{
+						writeElement(w, DENC, "AgreementMethod", {{"Algorithm", AGREEMENT_MTH}}, [&]{
+							w.writeNamespace(XENC11, "xenc11");
+							writeElement(w, XENC11, "KeyDerivationMethod", {{"Algorithm", CONCATKDF_MTH}}, [&]{
+								writeElement(w, XENC11, "ConcatKDFParams", {{"AlgorithmID", "00" + documentFormat.toHex()},
+									{"PartyUInfo", "00" + r.SsDer.toHex()}, {"PartyVInfo", m.partyVInfo}
+								}, [&]{
+									writeElement(w, DS, "DigestMethod", {{"Algorithm", r.concatDigest}});
+								});
+							});
+							writeElement(w, DENC, "OriginatorKeyInfo", [&]{
+								writeElement(w, DS, "KeyValue", [&]{
+									w.writeNamespace(DSIG11, "dsig11");
+									writeElement(w, DSIG11, "ECKeyValue", [&]{
+										writeElement(w, DSIG11, "NamedCurve", {{"URI", "urn:oid:" + m.oid}});
+										writeBase64Element(w, DSIG11, "PublicKey", r.SsDer);
+									});
+								});
+							});
+							writeElement(w, DENC, "RecipientKeyInfo", [&]{
+								writeElement(w, DS, "X509Data", [&]{
+									writeEncodedElement(w, DS, "X509Certificate", m.base64);
+								});
+							});
+						});
+					});
+				}
+				writeElement(w, DENC, "CipherData", [&]{
+					writeBase64Element(w, DENC, "CipherValue", r.cipher);
+				});
+			});
+		}});
+		writeElement(w,DENC, "CipherData", [&]{
+			w.writeStartElement(DENC, "CipherValue");
+			w.writeCharacters(QString()); // close start tag, payload is streamed directly to device
+			result = payload(cdoc);
+			w.writeEndElement();
+			// Properties follow payload, size is known only after compression
+			if(compressed)
+				props.insert("OriginalSize", QString::number(originalSize));
+		});
+		writeElement(w, DENC, "EncryptionProperties", [&]{
+			for(QHash<QString,QString>::const_iterator i = props.constBegin(); i != props.constEnd(); ++i)
+				writeElement(w, DENC, "EncryptionProperty", {{"Name", i.key()}}, [&]{ w.writeCharacters(i.value()); });
+		});
+	});
+	w.writeEndDocument();
+	return result && !w.hasError();
+}
+
+void CDoc::readDDoc(TempFile *ddoc)
+{
+	qCDebug(CRYPTO) << "Parsing DDOC container";
+	files.clear();
+	// DataFiles are only indexed, content stays in container until read
+	scanXml(ddoc, [&](const QList<QByteArray> &path, const QByteArray &tag, qint64 begin, qint64 end) {
+		if(path.size() != 2 || path[0] != "SignedDoc")
+			return true;
+		if(path[1] == "Signature")
+			hasSignature = true;
+		if(path[1] != "DataFile")
+			return true;
+		QXmlStreamReader x("<" + tag + (tag.endsWith('/') ? ">" : "/>"));
+		x.setNamespaceProcessing(false);
+		x.readNextStartElement();
+		File file;
+		file.name = x.attributes().value("Filename").toString().normalized(QString::NormalizationForm_C);
+		file.id = x.attributes().value("Id").toString().normalized(QString::NormalizationForm_C);
+		file.mime = x.attributes().value("MimeType").toString().normalized(QString::NormalizationForm_C);
+		file.path = ddoc->fileName();
+		file.offset = begin;
+		file.encodedSize = end - begin;
+		bool converted = false;
+		file.decodedSize = x.attributes().value("Size").toLongLong(&converted);
+		if(!converted)
+			file.decodedSize = file.encodedSize / 65 * 48;
+		files << file;
+		return true;
+	});
+	qCDebug(CRYPTO) << "Container contains signature" << hasSignature;
+}
+
+bool CDoc::writeDDoc(QIODevice *ddoc)
+{
+	qCDebug(CRYPTO) << "Creating DDOC container";
+	QXmlStreamWriter x(ddoc);
+	x.setAutoFormatting(true);
+	x.writeStartDocument();
+	x.writeDefaultNamespace("http://www.sk.ee/DigiDoc/v1.3.0#");
+	x.writeStartElement("SignedDoc");
+	writeAttributes(x, {{"format", "DIGIDOC-XML"}, {"version", "1.3"}});
+
+	for(const File &file: qAsConst(files))
+	{
+		x.writeStartElement("DataFile");
+		writeAttributes(x, {{"ContentType", "EMBEDDED_BASE64"}, {"Filename", file.name},
+			{"Id", file.id}, {"MimeType", file.mime}, {"Size", QString::number(file.length())}});
+		x.writeDefaultNamespace("http://www.sk.ee/DigiDoc/v1.3.0#");
+		// Encoder carries partial lines between reads, decoded DataFiles are not read in multiples of 3
+		x.writeCharacters(QString());
+		FunctionSink sink([&](const char *data, qint64 size) { return ddoc->write(data, size) == size; });
+		FilterChain chain(&sink);
+		chain.append(new Base64Encoder(chain.head()));
+		if(!file.read([&](const char *data, qint64 size) { return chain.write(data, size) && progressed(size); }) ||
+			!chain.finish())
+		{
+			qCWarning(CRYPTO) << "Failed to read file" << file.name;
+			return false;
+		}
+		x.writeEndElement(); //DataFile
+	}
+
+	x.writeEndElement(); //SignedDoc
+	x.writeEndDocument();
+	return !x.hasError();
+}
+
+
+
+std::shared_ptr<const CKeyMaterial> CKeyMaterial::get(const QByteArray &der)
+{
+	typedef std::shared_ptr<const CKeyMaterial> Ptr;
+	static QMutex mutex;
+	static QCache<QByteArray,Ptr> cache(1000);
+
+	if(der.isEmpty())
+		return nullptr;
+	QByteArray digest = QCryptographicHash::hash(der, QCryptographicHash::Sha256);
+	QMutexLocker lock(&mutex);
+	if(Ptr *cached = cache.object(digest))
+		return *cached;
+
+	std::shared_ptr<CKeyMaterial> m = std::make_shared<CKeyMaterial>();
+	pcuchar p = pcuchar(der.constData());
+	SCOPE(X509, x509, d2i_X509(nullptr, &p, der.size()));
+	m->publicKey.reset(x509 ? X509_get_pubkey(x509.get()) : nullptr, EVP_PKEY_free);
+	if(!m->publicKey)
+		return nullptr;
+	if(EVP_PKEY_base_id(m->publicKey.get()) == EVP_PKEY_EC)
+	{
+		SCOPE(EC_KEY, ec, EVP_PKEY_get1_EC_KEY(m->publicKey.get()));
+		m->curve = EC_GROUP_get_curve_name(EC_KEY_get0_group(ec.get()));
+		m->partyVInfo = "00" + der.toHex();
+		m->oid.resize(50);
+		m->oid.resize(OBJ_obj2txt(m->oid.data(), m->oid.size(), OBJ_nid2obj(m->curve), 1));
+	}
+	m->base64.resize(int(Base64::encodeSize(size_t(der.size()))));
+	m->base64.resize(int(Base64::encode(der.constData(), size_t(der.size()), m->base64.data())));
+	m->der = der;
+	cache.insert(digest, new Ptr(m));
+	return m;
+}
+
+
+
+const int EphemeralKeys::MAX;
+
+EphemeralKeys &EphemeralKeys::instance()
+{
+	static EphemeralKeys keys;
+	return keys;
+}
+
+std::shared_ptr<EVP_PKEY> EphemeralKeys::generate(int curve)
+{
+	SCOPE(EC_KEY, ec, EC_KEY_new_by_curve_name(curve));
+	std::shared_ptr<EVP_PKEY> pkey(EVP_PKEY_new(), EVP_PKEY_free);
+	if(!ec || !pkey ||
+		EC_KEY_generate_key(ec.get()) <= 0 ||
+		EVP_PKEY_set1_EC_KEY(pkey.get(), ec.get()) <= 0)
+		return nullptr;
+	return pkey;
+}
+
+void EphemeralKeys::reserve(int curve, int count)
+{
+	QMutexLocker lock(&mutex);
+	int &n = wanted[curve];
+	n = qBound(n, count, MAX);
+	if(running || ready.value(curve).size() >= n)
+		return;
+	running = true;
+	class Fill: public QRunnable
+	{
+		void run() override { EphemeralKeys::instance().fill(); }
+	};
+	QThreadPool::globalInstance()->start(new Fill);
+}
+
+std::shared_ptr<EVP_PKEY> EphemeralKeys::take(int curve)
+{
+	{
+		QMutexLocker lock(&mutex);
+		auto n = wanted.find(curve);
+		if(n != wanted.end() && n.value() > 0)
+			--n.value();
+		QList<std::shared_ptr<EVP_PKEY>> &list = ready[curve];
+		if(!list.isEmpty())
+			return list.takeLast();
+	}
+	return generate(curve);
+}
+
+void EphemeralKeys::fill()
+{
+	for(;;)
+	{
+		int curve = NID_undef;
+		{
+			QMutexLocker lock(&mutex);
+			for(auto i = wanted.constBegin(); i != wanted.constEnd() && curve == NID_undef; ++i)
+			{
+				if(ready.value(i.key()).size() < i.value())
+					curve = i.key();
+			}
+			if(curve == NID_undef)
+			{
+				running = false;
+				return;
+			}
+		}
+		std::shared_ptr<EVP_PKEY> pkey = generate(curve);
+		QMutexLocker lock(&mutex);
+		if(pkey)
+			ready[curve] << pkey;
+		else
+		{
+			// Unsupported curve, keys are generated in writeCDoc and errors reported there
+			qCWarning(CRYPTO) << "Failed to generate ephemeral key for curve" << curve;
+			ERR_clear_error();
+			wanted.remove(curve);
+		}
+	}
+}
+
+
+
+void CDocKey::setCert(const QByteArray &cert)
+{
+	der = cert;
+	material = CKeyMaterial::get(der);
+	// Subject common name, applications may replace it with friendlier name
+	recipient.clear();
+	pcuchar p = pcuchar(der.constData());
+	SCOPE(X509, x509, d2i_X509(nullptr, &p, der.size()));
+	X509_NAME *subject = x509 ? X509_get_subject_name(x509.get()) : nullptr;
+	int pos = subject ? X509_NAME_get_index_by_NID(subject, NID_commonName, -1) : -1;
+	uchar *cn = nullptr;
+	int len = pos >= 0 ? ASN1_STRING_to_UTF8(&cn, X509_NAME_ENTRY_get_data(X509_NAME_get_entry(subject, pos))) : -1;
+	if(len >= 0)
+		recipient = QString::fromUtf8(reinterpret_cast<const char*>(cn), len);
+	OPENSSL_free(cn);
+}
+
+bool CDocKey::isEC() const
+{
+	std::shared_ptr<const CKeyMaterial> m = material ? material : CKeyMaterial::get(der);
+	return m && EVP_PKEY_base_id(m->publicKey.get()) == EVP_PKEY_EC;
+}
+
+
+
+CDoc::CDoc() {}
+
+CDoc::~CDoc()
+{
+	clear();
+}
+
+bool CDoc::addFile(const QString &path, const QString &mime)
+{
+	if(isEncryptedError())
+		return false;
+	File f;
+	f.id = QString("D%1").arg(files.size());
+	f.mime = mime;
+	f.name = QFileInfo(path).fileName();
+	f.path = QFileInfo(path).absoluteFilePath();
+	files << f;
+	return true;
+}
+
+bool CDoc::addKey(const CDocKey &key)
+{
+	return addKeys(QList<CDocKey>() << key);
+}
+
+bool CDoc::addKeys(const QList<CDocKey> &list)
+{
+	if(isEncryptedError())
+		return false;
+	QStringList duplicates;
+	recipientKeys.reserve(recipientKeys.size() + list.size());
+	for(const CDocKey &k: list)
+	{
+		// Index also contains keys added earlier from same list
+		if(findKey(k.der) >= 0)
+		{
+			duplicates << k.recipient;
+			continue;
+		}
+		recipientKeys << k;
+		indexKey(recipientKeys.size() - 1);
+	}
+	// Ephemeral keys of EC recipients are generated in background until encrypt()
+	QHash<int,int> curves;
+	for(const CDocKey &k: recipientKeys)
+	{
+		if(k.material && k.material->curve != NID_undef)
+			++curves[k.material->curve];
+	}
+	for(auto i = curves.constBegin(); i != curves.constEnd(); ++i)
+		EphemeralKeys::instance().reserve(i.key(), i.value());
+	if(duplicates.isEmpty())
+		return true;
+	if(list.size() == 1)
+		lastError = tr("Key already exists");
+	else
+		lastError = tr("Keys already exist: %1").arg(duplicates.join(", "));
+	return false;
+}
+
+bool CDoc::canDecrypt(const QByteArray &der) const
+{
+	int id = findKey(der);
+	if(id < 0 || !ENC_MTH.contains(method))
+		return false;
+	// Certificate is decoded only for matching key
+	const CDocKey &k = recipientKeys.at(id);
+	bool ec = k.isEC();
+	if(!ec &&
+			!k.cipher.isEmpty() &&
+			k.method == RSA_MTH)
+		return true;
+	return ec &&
+		!k.publicKey.isEmpty() &&
+		!k.cipher.isEmpty() &&
+		KWAES_SIZE.contains(k.method) &&
+		k.derive == CONCATKDF_MTH &&
+		k.agreement == AGREEMENT_MTH;
+}
+
+void CDoc::clear(const QString &file)
+{
+	delete payload;
+	for(const QString &file: qAsConst(tempFiles))
+		QFile::remove(file);
+	tempFiles.clear();
+	payload = nullptr;
+	hasSignature = false;
+	encrypted = false;
+	fileName = file;
+	files.clear();
+	recipientKeys.clear();
+	digestIndex.clear();
+	issuerSerialIndex.clear();
+	properties.clear();
+	method.clear();
+	mime.clear();
+	key.clear();
+	payloadBegin = payloadEnd = -1;
+}
+
+QByteArray CDoc::concatKDF(QCryptographicHash::Algorithm hashAlg, quint32 keyDataLen, const QByteArray &z, const QByteArray &otherInfo)
+{
+	quint32 hashLen = 0;
+	switch(hashAlg)
+	{
+	case QCryptographicHash::Sha256: hashLen = 32; break;
+	case QCryptographicHash::Sha384: hashLen = 48; break;
+	case QCryptographicHash::Sha512: hashLen = 64; break;
+	default: return QByteArray();
+	}
+	quint32 reps = quint32(std::ceil(double(keyDataLen) / double(hashLen)));
+	QCryptographicHash md(hashAlg);
+	QByteArray key;
+	for(quint32 i = 1; i <= reps; i++)
+	{
+		quint32 intToFourBytes = qToBigEndian(i);
+		md.reset();
+		md.addData((const char*)&intToFourBytes, 4);
+		md.addData(z);
+		md.addData(otherInfo);
+		key += md.result();
+	}
+	return key.left(int(keyDataLen));
+}
+
+bool CDoc::decrypt()
+{
+	if(fileName.isEmpty())
+	{
+		lastError = tr("Container is not open");
+		return false;
+	}
+	if(!encrypted)
+		return true;
+	if(key.isEmpty())
+	{
+		lastError = tr("You do not have the key to decrypt this document");
+		return false;
+	}
+
+	qCDebug(CRYPTO) << "Decrypt" << fileName;
+	lastError.clear();
+	processed = 0;
+	// Payload range is recorded by open()
+	QFile cdoc(fileName);
+	if(!cdoc.open(QFile::ReadOnly) || (payloadBegin < 0 && !findPayload(&cdoc)))
+	{
+		lastError = tr("Error parsing document");
+		return false;
+	}
+
+	// Plaintext is kept in memory or temporary file and exposed only when payload is verified
+	std::unique_ptr<TempFile> result(new TempFile);
+	if(!result->open())
+	{
+		lastError = tr("Failed to create temporary files<br />%1").arg(result->errorString());
+		return false;
+	}
+	qCDebug(CRYPTO) << "Decrypting payload size" << payloadEnd - payloadBegin;
+	total = payloadEnd - payloadBegin;
+	if(!decryptPayload(&cdoc, result.get()) || !result->flush())
+		return false;
+	cdoc.close();
+	result->reset();
+
+	if(mime == MIME_ZLIB)
+		mime = properties["OriginalMimeType"];
+
+	if(mime == MIME_DDOC || mime == MIME_DDOC_OLD)
+	{
+		qCDebug(CRYPTO) << "Contains DDoc content" << mime;
+		payload = result.release();
+		readDDoc(payload);
+	}
+	else
+	{
+		qCDebug(CRYPTO) << "Contains raw file" << mime;
+		payload = result.release();
+		if(!files.isEmpty())
+			files[0].path = payload->fileName();
+		else if(properties.contains("Filename"))
+		{
+			File f;
+			f.name = properties["Filename"];
+			f.mime = mime;
+			f.path = payload->fileName();
+			files << f;
+		}
+		else
+			lastError = tr("Error parsing document");
+	}
+	encrypted = false;
+	return lastError.isEmpty();
+}
+
+bool CDoc::decrypt(const CDocKey &k, const KeyAgreement &agreement)
+{
+	if(encrypted && k.der.isEmpty())
+	{
+		lastError = tr("You do not have the key to decrypt this document");
+		return false;
+	}
+	return !encrypted || (unwrapKey(k, agreement(k)) && decrypt());
+}
+
+bool CDoc::verify()
+{
+	if(fileName.isEmpty())
+	{
+		lastError = tr("Container is not open");
+		return false;
+	}
+	if(!encrypted)
+		return true;
+	if(key.isEmpty())
+	{
+		lastError = tr("You do not have the key to decrypt this document");
+		return false;
+	}
+
+	qCDebug(CRYPTO) << "Verify" << fileName;
+	lastError.clear();
+	processed = 0;
+	QFile cdoc(fileName);
+	if(!cdoc.open(QFile::ReadOnly) || (payloadBegin < 0 && !findPayload(&cdoc)))
+	{
+		lastError = tr("Error parsing document");
+		return false;
+	}
+	// Plaintext is discarded, tag, padding and zlib stream are checked by filters
+	total = payloadEnd - payloadBegin;
+	FunctionSink sink([](const char *, qint64) { return true; });
+	return decryptPayload(&cdoc, &sink);
+}
+
+bool CDoc::encrypt(const QString &file)
+{
+	if(!file.isEmpty())
+		fileName = file;
+	if(fileName.isEmpty())
+	{
+		lastError = tr("Container is not open");
+		return false;
+	}
+	if(encrypted)
+		return true;
+	if(recipientKeys.isEmpty())
+	{
+		lastError = tr("No keys specified");
+		return false;
+	}
+	if(files.isEmpty())
+	{
+		lastError = tr("Failed to encrypt document");
+		return false;
+	}
+
+	qCDebug(CRYPTO) << "Encrypt" << fileName;
+	lastError.clear();
+	processed = total = 0;
+	for(const File &file: qAsConst(files))
+		total += file.length();
+	QString mime, name;
+	bool container = files.size() > 1 || withDDoc;
+	if(container)
+	{
+		qCDebug(CRYPTO) << "Creating DDoc container";
+		mime = MIME_DDOC;
+		name = QFileInfo(fileName).completeBaseName() + ".ddoc";
+	}
+	else
+	{
+		qCDebug(CRYPTO) << "Adding raw file";
+		mime = files[0].mime;
+		name = files[0].name;
+	}
+
+	method = withDDoc ? AES128CBC_MTH : AES256GCM_MTH;
+	QString version = method == AES128CBC_MTH ? "1.0" : "1.1";
+	// Independently authenticated payload segments are readable only by segment aware clients
+	segment = method == AES128CBC_MTH || segmentSize <= 0 ? 0 :
+		qBound<qint64>(SegmentFilter::MIN_SEGMENT, segmentSize, SegmentFilter::MAX_SEGMENT);
+	// zlib payload only when sample shows data compresses
+	compressed = compress && isCompressible();
+
+#ifdef WIN32
+	RAND_screen();
+#else
+	RAND_load_file("/dev/urandom", 1024);
+#endif
+	key.resize(EVP_CIPHER_key_length(ENC_MTH[method]));
+	if(opensslError(RAND_bytes(puchar(key.data()), key.size()) <= 0))
+	{
+		lastError = tr("Failed to encrypt document");
+		return false;
+	}
+
+	QMultiHash<QString,QString> props;
+	props.insert("DocumentFormat", "ENCDOC-XML|" + version);
+	props.insert("LibraryVersion", QCoreApplication::applicationName() + "|" + QCoreApplication::applicationVersion());
+	props.insert("Filename", name);
+	if(compressed)
+		props.insert("OriginalMimeType", mime);
+	if(segment > 0)
+		props.insert("PayloadSegmentSize", QString::number(segment));
+	QList<File> reverse = files;
+	std::reverse(reverse.begin(), reverse.end());
+	for(const File &file: qAsConst(reverse))
+		props.insert("orig_file", QString("%1|%2|%3|%4").arg(file.name).arg(file.length()).arg(file.mime).arg(file.id));
+
+	// Payload is encrypted and encoded directly into CipherValue
+	QFile cdoc(fileName);
+	bool result = cdoc.open(QFile::WriteOnly) &&
+		writeCDoc(&cdoc, key, props, [&](QIODevice *out) { return encryptPayload(out, container); }, mime) &&
+		cdoc.flush();
+	cdoc.close();
+
+	delete payload;
+	payload = nullptr;
+	if(!result)
+	{
+		cdoc.remove();
+		if(lastError.isEmpty())
+			lastError = tr("Failed to encrypt document");
+		return false;
+	}
+	encrypted = true;
+	return true;
+}
+
+int CDoc::findKey(const QByteArray &der) const
+{
+	if(der.isEmpty())
+		return -1;
+	int id = digestIndex.value(QCryptographicHash::hash(der, QCryptographicHash::Sha256), -1);
+	if(id >= 0)
+		return id;
+	// Same certificate with different encoding
+	QByteArray name = issuerSerial(der);
+	return name.isEmpty() ? -1 : issuerSerialIndex.value(name, -1);
+}
+
+bool CDoc::isEncryptedError()
+{
+	if(fileName.isEmpty())
+		lastError = tr("Container is not open");
+	else if(encrypted)
+		lastError = tr("Container is encrypted");
+	return fileName.isEmpty() || encrypted;
+}
+
+bool CDoc::open(const QString &file)
+{
+	clear(file);
+	QFile cdoc(fileName);
+	cdoc.open(QFile::ReadOnly);
+	readCDoc(&cdoc);
+	cdoc.close();
+
+	if(files.isEmpty() && properties.contains("Filename"))
+	{
+		File f;
+		f.name = properties["Filename"];
+		f.mime = mime == MIME_ZLIB ? properties["OriginalMimeType"] : mime;
+		f.size = properties["OriginalSize"];
+		files << f;
+	}
+
+	encrypted = true;
+	return !recipientKeys.isEmpty();
+}
+
+bool CDoc::progressed(qint64 size)
+{
+	processed += size;
+	return !progress || progress(qMin(processed, total), total);
+}
+
+bool CDoc::removeKey(int id)
+{
+	if(isEncryptedError())
+		return false;
+	if(id < 0 || id >= recipientKeys.size())
+		return false;
+	recipientKeys.removeAt(id);
+	digestIndex.clear();
+	issuerSerialIndex.clear();
+	for(int i = 0; i < recipientKeys.size(); ++i)
+		indexKey(i);
+	return true;
+}
+
+bool CDoc::rewrap(const QList<CDocKey> &recipients, const QString &file)
+{
+	if(fileName.isEmpty())
+	{
+		lastError = tr("Container is not open");
+		return false;
+	}
+	if(!encrypted)
+	{
+		lastError = tr("Container is not encrypted");
+		return false;
+	}
+	if(recipients.isEmpty())
+	{
+		lastError = tr("No keys specified");
+		return false;
+	}
+	if(!ENC_MTH.contains(method) || key.size() != EVP_CIPHER_key_length(ENC_MTH[method]))
+	{
+		lastError = tr("You do not have the key to decrypt this document");
+		return false;
+	}
+
+	QString target = file.isEmpty() ? fileName : file;
+	qCDebug(CRYPTO) << "Rewrap" << fileName << "to" << target << recipients.size() << "recipients";
+	lastError.clear();
+	processed = 0;
+	QFile cdoc(fileName);
+	if(!cdoc.open(QFile::ReadOnly) || (payloadBegin < 0 && !findPayload(&cdoc)))
+	{
+		lastError = tr("Error parsing document");
+		return false;
+	}
+	total = payloadEnd - payloadBegin;
+
+	// Properties and file list are kept as read, payload is already compressed when needed
+	QMultiHash<QString,QString> props;
+	for(QHash<QString,QString>::const_iterator i = properties.constBegin(); i != properties.constEnd(); ++i)
+		props.insert(i.key(), i.value());
+	if(!props.contains("DocumentFormat"))
+		props.insert("DocumentFormat", method == AES128CBC_MTH ? "ENCDOC-XML|1.0" : "ENCDOC-XML|1.1");
+	props.replace("LibraryVersion", QCoreApplication::applicationName() + "|" + QCoreApplication::applicationVersion());
+	for(int i = files.size() - 1; i >= 0; --i)
+	{
+		// Entry added by open() for documents without file list has no id
+		const File &f = files.at(i);
+		if(!f.id.isEmpty())
+			props.insert("orig_file", QString("%1|%2|%3|%4").arg(f.name).arg(f.size).arg(f.mime).arg(f.id));
+	}
+
+	// Recipients are matched like in addKeys(), re-issued certificate of same recipient is skipped
+	QList<CDocKey> previous = recipientKeys;
+	QHash<QByteArray,int> previousDigests = digestIndex, previousIssuerSerials = issuerSerialIndex;
+	recipientKeys.clear();
+	digestIndex.clear();
+	issuerSerialIndex.clear();
+	for(const CDocKey &k: recipients)
+	{
+		if(findKey(k.der) >= 0)
+			continue;
+		recipientKeys << k;
+		indexKey(recipientKeys.size() - 1);
+	}
+	compressed = false;
+
+	// Only EncryptedKey elements are new, base64 CipherValue is copied as is
+	QSaveFile out(target);
+	bool result = out.open(QFile::WriteOnly) &&
+		writeCDoc(&out, key, props, [&](QIODevice *dst) {
+			return File::readRange(cdoc, payloadBegin, payloadEnd, [&](const char *data, qint64 size) {
+				return dst->write(data, size) == size && progressed(size);
+			});
+		}, mime);
+	cdoc.close();
+	if(!result || !out.commit())
+	{
+		out.cancelWriting();
+		recipientKeys = previous;
+		digestIndex = previousDigests;
+		issuerSerialIndex = previousIssuerSerials;
+		if(lastError.isEmpty())
+			lastError = tr("Failed to encrypt document");
+		return false;
+	}
+
+	// Transport key stays valid for decrypting rewritten document
+	QByteArray transportKey = key;
+	open(target);
+	key = transportKey;
+	return true;
+}
+
+bool CDoc::saveDDoc(const QString &file)
+{
+	if(!payload || (mime != MIME_DDOC && mime != MIME_DDOC_OLD))
+	{
+		lastError = tr("Document not open");
+		return false;
+	}
+	if(!payload->flush() || !QFile::copy(payload->fileName(), file))
+	{
+		lastError = tr("Failed to save file");
+		return false;
+	}
+	return true;
+}
+
+void CDoc::swap(CDoc &other)
+{
+	std::swap(fileName, other.fileName);
+	std::swap(lastError, other.lastError);
+	std::swap(method, other.method);
+	std::swap(mime, other.mime);
+	std::swap(properties, other.properties);
+	std::swap(recipientKeys, other.recipientKeys);
+	std::swap(files, other.files);
+	std::swap(hasSignature, other.hasSignature);
+	std::swap(encrypted, other.encrypted);
+	std::swap(key, other.key);
+	std::swap(payloadBegin, other.payloadBegin);
+	std::swap(payloadEnd, other.payloadEnd);
+	std::swap(segment, other.segment);
+	std::swap(originalSize, other.originalSize);
+	std::swap(compressed, other.compressed);
+	std::swap(payload, other.payload);
+	std::swap(digestIndex, other.digestIndex);
+	std::swap(issuerSerialIndex, other.issuerSerialIndex);
+}
+
+bool CDoc::unwrapKey(const CDocKey &k, const QByteArray &agreement)
+{
+	key.clear();
+	if(agreement.isEmpty())
+	{
+		lastError = tr("Failed to decrypt document");
+		return false;
+	}
+	if(k.isEC())
+	{
+#ifndef NDEBUG
+		qDebug() << "DEC Ss" << k.publicKey.toHex();
+		qDebug() << "DEC ConcatKDF" << agreement.toHex();
+#endif
+		key = AES_wrap(agreement, k.cipher, false);
+		if(opensslError(key.isEmpty()))
+		{
+			lastError = tr("Failed to decrypt document");
+			return false;
+		}
+	}
+	else // RSA decrypts directly transport key
+		key = agreement;
+#ifndef NDEBUG
+	qDebug() << "DEC transport" << key.toHex();
+#endif
+	return true;
+}
@@ -0,0 +1,166 @@
+/*
+ * QDigiDocCrypto
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#pragma once
+
+#include <QtCore/QCoreApplication>
+#include <QtCore/QCryptographicHash>
+#include <QtCore/QHash>
+#include <QtCore/QStringList>
+
+#include <functional>
+#include <memory>
+
+class QFile;
+class QIODevice;
+class TempFile;
+struct CKeyMaterial;
+
+// Recipient of CDOC document, certificate is kept as DER
+class CDocKey
+{
+public:
+	CDocKey() {}
+	explicit CDocKey( const QByteArray &der ) { setCert( der ); }
+	void setCert( const QByteArray &der );
+	bool isEC() const;
+	bool operator==( const CDocKey &other ) const { return other.der == der; }
+
+	QByteArray der;
+	QString id, name, recipient, method, agreement, derive, concatDigest;
+	QByteArray AlgorithmID, PartyUInfo, PartyVInfo;
+	QByteArray cipher, publicKey;
+	// Decoded certificate shared between documents, set by setCert()
+	std::shared_ptr<const CKeyMaterial> material;
+};
+
+// CDOC reader and writer depending only on QtCore and OpenSSL. Failures are reported
+// by return value and lastError, private key operations are done by caller.
+class CDoc
+{
+	Q_DECLARE_TR_FUNCTIONS(CryptoDoc)
+public:
+	struct File
+	{
+		QString name, id, mime, size;
+		QByteArray data;
+		QString path;
+		// Base64 range of DataFile in DDOC at path, decoded on read
+		qint64 offset = -1, encodedSize = 0, decodedSize = 0;
+
+		qint64 length() const;
+		bool read( const std::function<bool (const char *data, qint64 size)> &f ) const;
+		bool save( const QString &dst ) const;
+		static bool readRange( QFile &file, qint64 begin, qint64 end,
+			const std::function<bool (const char *data, qint64 size)> &f );
+	};
+	// Private key operation for key: RSA decrypted cipher or ECDH ConcatKDF derived key encryption key,
+	// empty on failure
+	typedef std::function<QByteArray (const CDocKey &key)> KeyAgreement;
+	// Processed and total payload bytes, returning false cancels operation at next chunk
+	typedef std::function<bool (qint64 processed, qint64 total)> Progress;
+
+	CDoc();
+	~CDoc();
+
+	bool addFile( const QString &path, const QString &mime = "application/octet-stream" );
+	bool addKey( const CDocKey &key );
+	// Adds recipients missing from document, duplicates are skipped and listed in lastError
+	bool addKeys( const QList<CDocKey> &keys );
+	bool canDecrypt( const QByteArray &der ) const;
+	void clear( const QString &file = QString() );
+	// Decrypts payload with transport key set by unwrapKey()
+	bool decrypt();
+	bool decrypt( const CDocKey &key, const KeyAgreement &agreement );
+	bool encrypt( const QString &file = QString() );
+	// Index of recipient with certificate, matched by digest or issuer and serial, -1 when not found
+	int findKey( const QByteArray &der ) const;
+	// Recipients, modified with addKey(), addKeys() and removeKey() to keep lookup index current
+	const QList<CDocKey> &keys() const { return recipientKeys; }
+	bool open( const QString &file );
+	// Indexes DataFiles of DDOC container, contents are decoded from ddoc when read
+	void readDDoc( TempFile *ddoc );
+	bool removeKey( int id );
+	// Replaces recipients of encrypted document without decrypting payload. Transport key is set
+	// by unwrapKey(), document is written to file or in place and reopened.
+	bool rewrap( const QList<CDocKey> &recipients, const QString &file = QString() );
+	bool saveDDoc( const QString &file );
+	// Exchanges document state with other, options, progress and tempFiles are kept. Operations
+	// can run on separate document and publish result with swap().
+	void swap( CDoc &other );
+	// Sets transport key from key agreement result of key
+	bool unwrapKey( const CDocKey &key, const QByteArray &agreement );
+	// Decrypts payload with transport key set by unwrapKey() without keeping plaintext,
+	// fails when GCM tag, padding or compressed stream do not verify
+	bool verify();
+	// Writes files as DDOC container, payload of version 1.0 documents
+	bool writeDDoc( QIODevice *ddoc );
+
+	static QByteArray concatKDF(QCryptographicHash::Algorithm hashAlg,
+		quint32 keyDataLen, const QByteArray &z, const QByteArray &otherInfo);
+
+	// Options of encrypt(): version 1.0 with DDOC and AES-128-CBC, zlib payload when sample
+	// compresses and AES-GCM segment size
+	bool withDDoc = false, compress = false;
+	qint64 segmentSize = 0;
+	Progress progress;
+
+	QString			fileName, lastError, method, mime;
+	QHash<QString,QString> properties;
+	QList<File>		files;
+	QStringList		tempFiles;
+	bool			hasSignature = false, encrypted = false;
+
+	static const QString MIME_XML, MIME_ZLIB, MIME_DDOC, MIME_DDOC_OLD;
+	static const QString DS, DENC, DSIG11, XENC11;
+	static const QString AES128CBC_MTH, AES192CBC_MTH, AES256CBC_MTH, AES128GCM_MTH, AES192GCM_MTH, AES256GCM_MTH,
+		RSA_MTH, KWAES128_MTH, KWAES192_MTH, KWAES256_MTH, CONCATKDF_MTH, AGREEMENT_MTH, SHA256_MTH, SHA384_MTH, SHA512_MTH;
+	static const QHash<QString, QCryptographicHash::Algorithm> SHA_MTH;
+	static const QHash<QString, quint32> KWAES_SIZE;
+
+protected:
+	// Sets lastError when document is not open or is encrypted
+	bool isEncryptedError();
+
+private:
+	Q_DISABLE_COPY(CDoc)
+
+	static QByteArray AES_wrap(const QByteArray &key, const QByteArray &data, bool encrypt);
+	bool decryptPayload(QIODevice *cdoc, QIODevice *out);
+	bool encryptPayload(QIODevice *cdoc, bool ddoc);
+	bool findPayload(QIODevice *cdoc);
+	static QByteArray fromBase64(const QStringRef &data);
+	void indexKey(int id);
+	bool isCompressible() const;
+	static bool opensslError(bool err);
+	bool progressed(qint64 size);
+	void readCDoc(QIODevice *cdoc);
+	bool writeCDoc(QIODevice *cdoc, const QByteArray &transportKey, QMultiHash<QString,QString> props,
+		const std::function<bool (QIODevice *cdoc)> &payload, const QString &mime);
+
+	QByteArray		key;
+	QList<CDocKey>	recipientKeys;
+	qint64			payloadBegin = -1, payloadEnd = -1, segment = 0, originalSize = 0;
+	qint64			processed = 0, total = 0;
+	bool			compressed = false;
+	// Decrypted DDOC or raw file, kept in memory when small
+	TempFile		*payload = nullptr;
+	// Positions in recipientKeys by certificate SHA-256 and by DER issuer name and serial number
+	QHash<QByteArray,int> digestIndex, issuerSerialIndex;
+};
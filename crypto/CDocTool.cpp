@@ -0,0 +1,206 @@
+/*
+ * QDigiDocCrypto
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+// Headless batch encryption, every file is encrypted to all recipients into its own CDOC.
+// Jobs run on worker pool and stream files through bounded CDoc buffers, so memory per job
+// does not depend on file size. Exit code is 1 when any file fails and 2 on usage errors.
+//
+// cdoc-tool --encrypt --recipients certs.pem [--out dir] [--jobs n] [--compress] [--ddoc] files...
+
+#include "CDoc.h"
+#include "StreamFilter.h"
+
+#include <QtCore/QCoreApplication>
+#include <QtCore/QCryptographicHash>
+#include <QtCore/QDir>
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QFile>
+#include <QtCore/QFileInfo>
+#include <QtCore/QHash>
+#include <QtCore/QMutex>
+#include <QtCore/QSet>
+#include <QtCore/QThread>
+
+#include <openssl/err.h>
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+
+#include <atomic>
+#include <cstdio>
+#include <memory>
+
+static int usage()
+{
+	fprintf(stderr, "Usage: %s --encrypt --recipients certs.pem [--out dir] [--jobs n] [--compress] [--ddoc] files...\n"
+		"  --recipients  PEM file with recipient certificates or single DER certificate\n"
+		"  --out         directory of encrypted documents, default is next to file\n"
+		"  --jobs        documents encrypted in parallel, default %d\n"
+		"  --compress    compress payload when file compresses\n"
+		"  --ddoc        write version 1.0 documents with DDOC container\n",
+		qPrintable(QCoreApplication::applicationName()), QThread::idealThreadCount());
+	return 2;
+}
+
+static QList<CDocKey> readRecipients(const QString &path)
+{
+	QList<CDocKey> result;
+	QFile f(path);
+	if(!f.open(QFile::ReadOnly))
+		return result;
+	QByteArray data = f.readAll();
+	std::unique_ptr<BIO,decltype(&BIO_free)> bio(BIO_new_mem_buf(data.constData(), data.size()), BIO_free);
+	while(X509 *x509 = PEM_read_bio_X509(bio.get(), nullptr, nullptr, nullptr))
+	{
+		QByteArray der(i2d_X509(x509, nullptr), 0);
+		unsigned char *p = reinterpret_cast<unsigned char*>(der.data());
+		i2d_X509(x509, &p);
+		X509_free(x509);
+		result << CDocKey(der);
+	}
+	ERR_clear_error();
+	if(result.isEmpty() && !data.isEmpty())
+		result << CDocKey(data);
+	return result;
+}
+
+int main(int argc, char *argv[])
+{
+	QCoreApplication app(argc, argv);
+	app.setApplicationName("cdoc-tool");
+	app.setApplicationVersion(VERSION);
+
+	QStringList args = app.arguments();
+	args.removeFirst();
+	QString recipients, out;
+	QStringList files;
+	int jobs = QThread::idealThreadCount();
+	bool encrypt = false, compress = false, ddoc = false;
+	for(int i = 0; i < args.size(); ++i)
+	{
+		const QString &arg = args[i];
+		if(arg == "--encrypt")
+			encrypt = true;
+		else if(arg == "--recipients" && i + 1 < args.size())
+			recipients = args[++i];
+		else if(arg == "--out" && i + 1 < args.size())
+			out = args[++i];
+		else if(arg == "--jobs" && i + 1 < args.size())
+			jobs = args[++i].toInt();
+		else if(arg == "--compress")
+			compress = true;
+		else if(arg == "--ddoc")
+			ddoc = true;
+		else if(arg == "--")
+		{
+			files << args.mid(i + 1);
+			break;
+		}
+		else if(arg.startsWith("--"))
+			return usage();
+		else
+			files << arg;
+	}
+	if(!encrypt || recipients.isEmpty() || files.isEmpty() || jobs < 1)
+		return usage();
+
+	QList<CDocKey> keys = readRecipients(recipients);
+	if(keys.isEmpty())
+		return fprintf(stderr, "No recipient certificates in %s\n", qPrintable(recipients)), 2;
+	// Certificate listed more than once is one recipient, addKeys() would reject every document
+	QSet<QByteArray> digests;
+	for(auto i = keys.begin(); i != keys.end();)
+	{
+		if(!i->material)
+			return fprintf(stderr, "Invalid recipient certificate in %s\n", qPrintable(recipients)), 2;
+		QByteArray digest = QCryptographicHash::hash(i->der, QCryptographicHash::Sha256);
+		if(digests.contains(digest))
+			i = keys.erase(i);
+		else
+		{
+			digests << digest;
+			++i;
+		}
+	}
+	if(!out.isEmpty() && !QDir().mkpath(out))
+		return fprintf(stderr, "Failed to create directory %s\n", qPrintable(out)), 2;
+
+	// Destinations are checked before jobs start, inputs with same name would write same document
+	QStringList targets, errors;
+	QHash<QString,int> owners;
+	for(const QString &file: files)
+	{
+		QFileInfo in(file);
+		QString dst = QDir(out.isEmpty() ? in.absolutePath() : out).filePath(in.fileName() + ".cdoc");
+		QString key = QFileInfo(dst).absoluteFilePath();
+#if defined(Q_OS_WIN) || defined(Q_OS_MAC)
+		key = key.toLower();
+#endif
+		QString error;
+		if(!in.isFile())
+			error = "File not found";
+		else if(owners.contains(key))
+			error = QString("Document %1 is also output of %2").arg(dst, files.at(owners.value(key)));
+		else if(QFile::exists(dst))
+			error = "Document already exists";
+		if(error.isEmpty())
+			owners.insert(key, targets.size());
+		targets << dst;
+		errors << error;
+	}
+
+	QMutex mutex;
+	std::atomic<int> failed(0);
+	std::atomic<qint64> total(0);
+	QElapsedTimer timer;
+	timer.start();
+	parallelFor(files.size(), [&](int i) {
+		QElapsedTimer t;
+		t.start();
+		QFileInfo in(files.at(i));
+		QString dst = targets.at(i);
+		QString error = errors.at(i);
+		if(error.isEmpty())
+		{
+			CDoc doc;
+			doc.withDDoc = ddoc;
+			doc.compress = compress;
+			doc.clear(dst);
+			if(!doc.addFile(in.absoluteFilePath()) || !doc.addKeys(keys) || !doc.encrypt())
+				error = doc.lastError.replace("<br />", " ");
+		}
+
+		QMutexLocker lock(&mutex);
+		if(!error.isEmpty())
+		{
+			++failed;
+			printf("FAIL %s: %s\n", qPrintable(in.filePath()), qPrintable(error));
+			fflush(stdout);
+			return;
+		}
+		total += in.size();
+		printf("OK   %s -> %s %lld bytes %.1f MB/s\n", qPrintable(in.filePath()), qPrintable(dst),
+			in.size(), in.size() / (qMax<qint64>(1, t.nsecsElapsed()) / 1e9) / 1e6);
+		fflush(stdout);
+	}, jobs);
+
+	double sec = qMax<qint64>(1, timer.nsecsElapsed()) / 1e9;
+	printf("%d documents, %d failed, %lld bytes in %.2f s, %.1f MB/s\n",
+		files.size(), int(failed), qint64(total), sec, total / sec / 1e6);
+	return failed > 0 ? 1 : 0;
+}
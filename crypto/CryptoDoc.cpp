@@ -19,6 +19,8 @@
 
 #include "CryptoDoc.h"
 
+#include "StreamFilter.h"
+
 #include "client/Application.h"
 #include "client/FileDialog.h"
 #include "client/QSigner.h"
@@ -27,422 +29,91 @@
 #include <common/SslCertificate.h>
 #include <common/TokenData.h>
 
-#include <QtCore/QBuffer>
-#include <QtCore/QCryptographicHash>
 #include <QtCore/QDir>
 #include <QtCore/QFileInfo>
+#include <QtCore/QFutureInterface>
 #include <QtCore/QLoggingCategory>
 #include <QtCore/QMimeData>
 #include <QtCore/QProcessEnvironment>
-#include <QtCore/QTemporaryFile>
-#include <QtCore/QtEndian>
+#include <QtCore/QSet>
 #include <QtCore/QThread>
 #include <QtCore/QUrl>
-#include <QtCore/QXmlStreamReader>
-#include <QtCore/QXmlStreamWriter>
 #include <QtGui/QDesktopServices>
 #include <QtNetwork/QSslKey>
 #include <QtWidgets/QMessageBox>
 
-#include <openssl/aes.h>
-#include <openssl/err.h>
-#include <openssl/evp.h>
-#include <openssl/rand.h>
-#include <openssl/rsa.h>
-#include <openssl/ecdh.h>
-#include <openssl/x509.h>
-
-#include <cmath>
 #include <memory>
 
-typedef uchar *puchar;
-typedef const uchar *pcuchar;
-
-#define SCOPE(TYPE, VAR, DATA) std::unique_ptr<TYPE,decltype(&TYPE##_free)> VAR(DATA, TYPE##_free)
-
-Q_LOGGING_CATEGORY(CRYPTO,"CRYPTO")
-
-#if QT_VERSION < 0x050700
-template <class T>
-constexpr typename std::add_const<T>::type& qAsConst(T& t) noexcept
-{
-        return t;
-}
-#endif
+Q_DECLARE_LOGGING_CATEGORY(CRYPTO)
 
-class CryptoDocPrivate: public QThread
+// Runs document operations on worker thread. Operation works on job, copy of document, and
+// finish() publishes result on owner thread. Document is not changed while job exists.
+class CryptoDocPrivate: public QThread, public CDoc
 {
 	Q_OBJECT
 public:
-	struct File
+	CryptoDocPrivate()
 	{
-		QString name, id, mime, size;
-		QByteArray data;
-	};
+		progress = [this](qint64 processed, qint64 total) {
+			if(total > 0)
+				future.setProgressValue(int(processed * PROGRESS / total));
+			return !future.isCanceled();
+		};
+	}
 
-	QByteArray AES_wrap(const QByteArray &key, const QByteArray &data, bool encrypt);
-	QByteArray crypto(const EVP_CIPHER *cipher, const QByteArray &data, bool encrypt);
+	bool isBusyWarning();
 	bool isEncryptedWarning();
-	QByteArray fromBase64(const QStringRef &data);
-	static bool opensslError(bool err);
-	QByteArray readCDoc(QIODevice *cdoc, bool data);
-	void readDDoc(QIODevice *ddoc);
-	void run();
+	void run() override;
 	void setLastError(const QString &err);
-	QString size(const QString &size)
+	static QString size(const File &file)
 	{
+		if(file.size.isEmpty())
+			return FileDialog::fileSize(quint64(file.length()));
 		bool converted = false;
-		quint64 result = size.toUInt(&converted);
-		return converted ? FileDialog::fileSize(result) : size;
+		quint64 result = file.size.toULongLong(&converted);
+		return converted ? FileDialog::fileSize(result) : file.size;
 	}
-	inline void waitForFinished()
+	inline void startOperation()
 	{
-		QEventLoop e;
-		connect(this, &CryptoDocPrivate::finished, &e, &QEventLoop::quit);
-		start();
-		e.exec();
+		future = QFutureInterface<bool>();
+		future.setProgressRange(0, PROGRESS);
+		future.reportStarted();
+		lastError.clear();
 	}
-	inline void writeAttributes(QXmlStreamWriter &x, const QMap<QString,QString> &attrs)
-	{
-		for(QMap<QString,QString>::const_iterator i = attrs.cbegin(), end = attrs.cend(); i != end; ++i)
-			x.writeAttribute(i.key(), i.value());
-	}
-	inline void writeElement(QXmlStreamWriter &x, const QString &ns, const QString &name, const std::function<void()> &f = nullptr)
-	{
-		x.writeStartElement(ns, name);
-		if(f)
-			f();
-		x.writeEndElement();
-	}
-	inline void writeElement(QXmlStreamWriter &x, const QString &ns, const QString &name, const QMap<QString,QString> &attrs, const std::function<void()> &f = nullptr)
-	{
-		x.writeStartElement(ns, name);
-		writeAttributes(x, attrs);
-		if(f)
-			f();
-		x.writeEndElement();
-	}
-	inline void writeBase64(QXmlStreamWriter &x, const QByteArray &data)
-	{
-		for(int i = 0; i < data.size(); i+=48)
-			x.writeCharacters(data.mid(i, 48).toBase64() + "\n");
-	}
-	inline void writeBase64Element(QXmlStreamWriter &x, const QString &ns, const QString &name, const QByteArray &data)
-	{
-		x.writeStartElement(ns, name);
-		writeBase64(x, data);
-		x.writeEndElement();
-	}
-	void writeCDoc(QIODevice *cdoc, const QByteArray &transportKey, const QByteArray &encryptedData,
-		const QString &file, const QString &ver, const QString &mime);
-	void writeDDoc(QIODevice *ddoc);
-
-	static const QString MIME_XML, MIME_ZLIB, MIME_DDOC, MIME_DDOC_OLD;
-	static const QString DS, DENC, DSIG11, XENC11;
-	static const QString AES128CBC_MTH, AES192CBC_MTH, AES256CBC_MTH, AES128GCM_MTH, AES192GCM_MTH, AES256GCM_MTH,
-		RSA_MTH, KWAES128_MTH, KWAES192_MTH, KWAES256_MTH, CONCATKDF_MTH, AGREEMENT_MTH, SHA256_MTH, SHA384_MTH, SHA512_MTH;
-	static const QHash<QString, const EVP_CIPHER*> ENC_MTH;
-	static const QHash<QString, QCryptographicHash::Algorithm> SHA_MTH;
-	static const QHash<QString, quint32> KWAES_SIZE;
-
-	QString			method, mime, fileName, lastError;
-	QByteArray		key;
-	QHash<QString,QString> properties;
-	QList<CKey>		keys;
-	QList<File>		files;
-	bool			hasSignature = false, encrypted = false;
-	CDocumentModel	*documents = nullptr;
-	QTemporaryFile	*ddoc = nullptr;
-	QStringList		tempFiles;
-};
 
-const QString CryptoDocPrivate::MIME_XML = "text/xml";
-const QString CryptoDocPrivate::MIME_ZLIB = "http://www.isi.edu/in-noes/iana/assignments/media-types/application/zip";
-const QString CryptoDocPrivate::MIME_DDOC = "http://www.sk.ee/DigiDoc/v1.3.0/digidoc.xsd";
-const QString CryptoDocPrivate::MIME_DDOC_OLD = "http://www.sk.ee/DigiDoc/1.3.0/digidoc.xsd";
-const QString CryptoDocPrivate::DS = "http://www.w3.org/2000/09/xmldsig#";
-const QString CryptoDocPrivate::DENC = "http://www.w3.org/2001/04/xmlenc#";
-const QString CryptoDocPrivate::DSIG11 = "http://www.w3.org/2009/xmldsig11#";
-const QString CryptoDocPrivate::XENC11 = "http://www.w3.org/2009/xmlenc11#";
-
-const QString CryptoDocPrivate::AES128CBC_MTH = "http://www.w3.org/2001/04/xmlenc#aes128-cbc";
-const QString CryptoDocPrivate::AES192CBC_MTH = "http://www.w3.org/2001/04/xmlenc#aes192-cbc";
-const QString CryptoDocPrivate::AES256CBC_MTH = "http://www.w3.org/2001/04/xmlenc#aes256-cbc";
-const QString CryptoDocPrivate::AES128GCM_MTH = "http://www.w3.org/2009/xmlenc11#aes128-gcm";
-const QString CryptoDocPrivate::AES192GCM_MTH = "http://www.w3.org/2009/xmlenc11#aes192-gcm";
-const QString CryptoDocPrivate::AES256GCM_MTH = "http://www.w3.org/2009/xmlenc11#aes256-gcm";
-const QString CryptoDocPrivate::RSA_MTH = "http://www.w3.org/2001/04/xmlenc#rsa-1_5";
-const QString CryptoDocPrivate::KWAES128_MTH = "http://www.w3.org/2001/04/xmlenc#kw-aes128";
-const QString CryptoDocPrivate::KWAES192_MTH = "http://www.w3.org/2001/04/xmlenc#kw-aes192";
-const QString CryptoDocPrivate::KWAES256_MTH = "http://www.w3.org/2001/04/xmlenc#kw-aes256";
-const QString CryptoDocPrivate::CONCATKDF_MTH = "http://www.w3.org/2009/xmlenc11#ConcatKDF";
-const QString CryptoDocPrivate::AGREEMENT_MTH = "http://www.w3.org/2009/xmlenc11#ECDH-ES";
-const QString CryptoDocPrivate::SHA256_MTH = "http://www.w3.org/2001/04/xmlenc#sha256";
-const QString CryptoDocPrivate::SHA384_MTH = "http://www.w3.org/2001/04/xmlenc#sha384";
-const QString CryptoDocPrivate::SHA512_MTH = "http://www.w3.org/2001/04/xmlenc#sha512";
-
-const QHash<QString, const EVP_CIPHER*> CryptoDocPrivate::ENC_MTH{
-	{AES128CBC_MTH, EVP_aes_128_cbc()}, {AES192CBC_MTH, EVP_aes_192_cbc()}, {AES256CBC_MTH, EVP_aes_256_cbc()},
-	{AES128GCM_MTH, EVP_aes_128_gcm()}, {AES192GCM_MTH, EVP_aes_192_gcm()}, {AES256GCM_MTH, EVP_aes_256_gcm()},
-};
-const QHash<QString, QCryptographicHash::Algorithm> CryptoDocPrivate::SHA_MTH{
-	{SHA256_MTH, QCryptographicHash::Sha256}, {SHA384_MTH, QCryptographicHash::Sha384}, {SHA512_MTH, QCryptographicHash::Sha512}
-};
-const QHash<QString, quint32> CryptoDocPrivate::KWAES_SIZE{{KWAES128_MTH, 16}, {KWAES192_MTH, 24}, {KWAES256_MTH, 32}};
-
-QByteArray CryptoDocPrivate::AES_wrap(const QByteArray &key, const QByteArray &data, bool encrypt)
-{
-	QByteArray result;
-	AES_KEY aes;
-	if(0 != (encrypt ?
-		AES_set_encrypt_key(pcuchar(key.data()), key.length() * 8, &aes) :
-		AES_set_decrypt_key(pcuchar(key.data()), key.length() * 8, &aes)))
-		return result;
-	result.resize(data.size() + 8);
-	int size = encrypt ?
-		AES_wrap_key(&aes, nullptr, puchar(result.data()), pcuchar(data.data()), uint(data.size())) :
-		AES_unwrap_key(&aes, nullptr, puchar(result.data()), pcuchar(data.data()), uint(data.size()));
-	if(size > 0)
-		result.resize(size);
-	else
-		result.clear();
-	return result;
-}
+	static const int PROGRESS = 1000;
 
-QByteArray CryptoDocPrivate::crypto(const EVP_CIPHER *cipher, const QByteArray &data, bool encrypt)
-{
-	QByteArray iv, _data, tag;
-	if(encrypt)
-	{
-#ifdef WIN32
-		RAND_screen();
-#else
-		RAND_load_file("/dev/urandom", 1024);
-#endif
-		_data = data;
-		iv.resize(EVP_CIPHER_iv_length(cipher));
-		key.resize(EVP_CIPHER_key_length(cipher));
-		uchar salt[PKCS5_SALT_LEN], indata[128];
-		RAND_bytes(salt, sizeof(salt));
-		RAND_bytes(indata, sizeof(indata));
-		if(opensslError(EVP_BytesToKey(cipher, EVP_sha256(), salt, indata, sizeof(indata),
-				1, puchar(key.data()), puchar(iv.data())) <= 0))
-			return QByteArray();
-	}
-	else
-	{
-		iv = data.left(EVP_CIPHER_iv_length(cipher));
-		if(EVP_CIPHER_mode(cipher) == EVP_CIPH_GCM_MODE)
-			tag = data.right(16);
-		_data = data.mid(iv.size(), data.size() - iv.size() - tag.size());
-	}
-
-	SCOPE(EVP_CIPHER_CTX, ctx, EVP_CIPHER_CTX_new());
-	if(opensslError(EVP_CipherInit(ctx.get(), cipher, pcuchar(key.constData()), pcuchar(iv.constData()), encrypt) <= 0))
-		return QByteArray();
-
-	int size = 0;
-	QByteArray result(_data.size() + EVP_CIPHER_CTX_block_size(ctx.get()), Qt::Uninitialized);
-	puchar resultPointer = puchar(result.data()); //Detach only once
-	if(opensslError(EVP_CipherUpdate(ctx.get(), resultPointer, &size, pcuchar(_data.constData()), _data.size()) <= 0))
-		return QByteArray();
-
-	if(!encrypt && EVP_CIPHER_mode(cipher) == EVP_CIPH_GCM_MODE)
-		EVP_CIPHER_CTX_ctrl(ctx.get(), EVP_CTRL_GCM_SET_TAG, tag.size(), tag.data());
-
-	int size2 = 0;
-	if(opensslError(EVP_CipherFinal(ctx.get(), resultPointer + size, &size2) <= 0))
-		return QByteArray();
-	result.resize(size + size2);
-	if(encrypt)
-	{
-		result.prepend(iv);
-		if(EVP_CIPHER_mode(cipher) == EVP_CIPH_GCM_MODE)
-		{
-			tag = QByteArray(16, 0);
-			EVP_CIPHER_CTX_ctrl(ctx.get(), EVP_CTRL_GCM_GET_TAG, tag.size(), tag.data());
-			result.append(tag);
-		}
-	}
-	return result;
-}
+	QFutureInterface<bool> future;
+	std::unique_ptr<CDoc> job;
+	bool			decrypting = false, rewrapping = false, result = false;
+	QList<CDocKey>	recipients;
+	CDocumentModel	*documents = nullptr;
+};
 
-QByteArray CryptoDocPrivate::fromBase64( const QStringRef &data )
+bool CryptoDocPrivate::isBusyWarning()
 {
-	unsigned int buf = 0;
-	int nbits = 0;
-	QByteArray result((data.size() * 3) / 4, Qt::Uninitialized);
-
-	int offset = 0;
-	for( int i = 0; i < data.size(); ++i )
-	{
-		int ch = data.at(i).toLatin1();
-		int d;
-
-		if (ch >= 'A' && ch <= 'Z')
-			d = ch - 'A';
-		else if (ch >= 'a' && ch <= 'z')
-			d = ch - 'a' + 26;
-		else if (ch >= '0' && ch <= '9')
-			d = ch - '0' + 52;
-		else if (ch == '+')
-			d = 62;
-		else if (ch == '/')
-			d = 63;
-		else
-			continue;
-
-		buf = (buf << 6) | uint(d);
-		nbits += 6;
-		if(nbits >= 8)
-		{
-			nbits -= 8;
-			result[offset++] = char(buf >> nbits);
-			buf &= (1 << nbits) - 1;
-		}
-	}
-
-	result.truncate(offset);
-	return result;
+	if(!job)
+		return false;
+	setLastError(CryptoDoc::tr("Document is being processed"));
+	return true;
 }
 
 bool CryptoDocPrivate::isEncryptedWarning()
 {
-	if( fileName.isEmpty() )
-		setLastError( CryptoDoc::tr("Container is not open") );
-	if( encrypted )
-		setLastError( CryptoDoc::tr("Container is encrypted") );
-	return fileName.isEmpty() || encrypted;
-}
-
-bool CryptoDocPrivate::opensslError(bool err)
-{
-	if(err)
-	{
-		unsigned long errorCode = 0;
-		while((errorCode =  ERR_get_error()) != 0)
-			qCWarning(CRYPTO) << ERR_error_string(errorCode, 0);
-	}
-	return err;
+	if(!isEncryptedError())
+		return false;
+	setLastError(lastError);
+	return true;
 }
 
 void CryptoDocPrivate::run()
 {
-	if( !encrypted )
-	{
-		qCDebug(CRYPTO) << "Encrypt" << fileName;
-		QBuffer data;
-		data.open(QBuffer::WriteOnly);
-
-		QString mime, name;
-		if(files.size() > 1 || Settings(qApp->applicationName()).value("cdocwithddoc", false).toBool())
-		{
-			qCDebug(CRYPTO) << "Creating DDoc container";
-			writeDDoc(&data);
-			mime = MIME_DDOC;
-			name = QFileInfo(fileName).completeBaseName() + ".ddoc";
-		}
-		else
-		{
-			qCDebug(CRYPTO) << "Adding raw file";
-			data.write(files[0].data);
-			mime = files[0].mime;
-			name = files[0].name;
-		}
-
-		if(Settings(qApp->applicationName()).value("cdocwithddoc", false).toBool())
-			method = AES128CBC_MTH;
-		else
-			method = AES256GCM_MTH;
-
-		QString version = "1.1";
-		if(method == AES128CBC_MTH) // add ANSIX923 padding
-		{
-			version = "1.0";
-			QByteArray ansix923(16 - (data.size() % 16), 0);
-			qCDebug(CRYPTO) << "Adding ANSIX923 padding size" << ansix923.size();
-			ansix923[ansix923.size() - 1] = char(ansix923.size());
-			data.write(ansix923);
-			data.close();
-		}
-
-		QByteArray result = crypto(ENC_MTH[method], data.data(), true);
-		QFile cdoc(fileName);
-		cdoc.open(QFile::WriteOnly);
-		writeCDoc(&cdoc, key, result, name, version, mime);
-		cdoc.close();
-
-		delete ddoc;
-		ddoc = nullptr;
-	}
+	if(rewrapping)
+		result = job->rewrap(recipients);
+	else if(decrypting)
+		result = job->decrypt();
 	else
-	{
-		qCDebug(CRYPTO) << "Decrypt" << fileName;
-		QFile cdoc(fileName);
-		cdoc.open(QFile::ReadOnly);
-		QByteArray result = readCDoc(&cdoc, true);
-		cdoc.close();
-		result = crypto(ENC_MTH[method], result, false);
-
-		// remove ANSIX923 padding
-		if(result.size() > 0 && method == AES128CBC_MTH)
-		{
-			QByteArray ansix923(result[result.size()-1], 0);
-			ansix923[ansix923.size()-1] = char(ansix923.size());
-			if(result.right(ansix923.size()) == ansix923)
-			{
-				qCDebug(CRYPTO) << "Removing ANSIX923 padding size:" << ansix923.size();
-				result.resize(result.size() - ansix923.size());
-			}
-		}
-
-		if(mime == MIME_ZLIB)
-		{
-			// Add size header for qUncompress compatibilty
-			unsigned int origsize = std::max<unsigned int>(properties["OriginalSize"].toUInt(), 1);
-			qCDebug(CRYPTO) << "Decompressing zlib content size" << origsize;
-			QByteArray size(4, 0);
-			size[0] = char((origsize & 0xff000000) >> 24);
-			size[1] = char((origsize & 0x00ff0000) >> 16);
-			size[2] = char((origsize & 0x0000ff00) >> 8);
-			size[3] = char((origsize & 0x000000ff));
-			result = qUncompress(size + result);
-			mime = properties["OriginalMimeType"];
-		}
-
-		if(mime == MIME_DDOC || mime == MIME_DDOC_OLD)
-		{
-			qCDebug(CRYPTO) << "Contains DDoc content" << mime;
-			ddoc = new QTemporaryFile( QDir().tempPath() + "/XXXXXX" );
-			if( !ddoc->open() )
-			{
-				lastError = CryptoDoc::tr("Failed to create temporary files<br />%1").arg( ddoc->errorString() );
-				return;
-			}
-			ddoc->write(result);
-			ddoc->flush();
-			ddoc->reset();
-			readDDoc(ddoc);
-		}
-		else
-		{
-			qCDebug(CRYPTO) << "Contains raw file" << mime;
-			if(!files.isEmpty())
-				files[0].data = result;
-			else if(properties.contains("Filename"))
-			{
-				File f;
-				f.name = properties["Filename"];
-				f.mime = mime;
-				f.size = FileDialog::fileSize(quint64(result.size()));
-				f.data = result;
-				files << f;
-			}
-			else
-				lastError = CryptoDoc::tr("Error parsing document");
-		}
-	}
-	encrypted = !encrypted;
+		result = job->encrypt();
 }
 
 void CryptoDocPrivate::setLastError( const QString &err )
@@ -451,323 +122,6 @@ void CryptoDocPrivate::setLastError( const QString &err )
 		err, QMessageBox::Close, qApp->activeWindow() );
 }
 
-QByteArray CryptoDocPrivate::readCDoc(QIODevice *cdoc, bool data)
-{
-	qCDebug(CRYPTO) << "Parsing CDOC file, reading data only" << data;
-	QXmlStreamReader xml(cdoc);
-
-	if(!data)
-	{
-		files.clear();
-		keys.clear();
-		properties.clear();
-		method.clear();
-		mime.clear();
-	}
-	while( !xml.atEnd() )
-	{
-		if( !xml.readNextStartElement() )
-			continue;
-		if(data)
-		{
-			// EncryptedData/KeyInfo
-			if(xml.name() == "KeyInfo")
-				xml.skipCurrentElement();
-			// EncryptedData/CipherData/CipherValue
-			else if(xml.name() == "CipherValue")
-			{
-				xml.readNext();
-				return fromBase64(xml.text());
-			}
-			continue;
-		}
-
-		// EncryptedData
-		else if( xml.name() == "EncryptedData")
-			mime = xml.attributes().value("MimeType").toString();
-		// EncryptedData/EncryptionProperties/EncryptionProperty
-		else if( xml.name() == "EncryptionProperty" )
-		{
-			for( const QXmlStreamAttribute &attr: xml.attributes() )
-			{
-				if( attr.name() != "Name" )
-					continue;
-				if( attr.value() == "orig_file" )
-				{
-					QStringList fileparts = xml.readElementText().split("|");
-					File file;
-					file.name = fileparts.value(0);
-					file.size = size(fileparts.value(1));
-					file.mime = fileparts.value(2);
-					file.id = fileparts.value(3);
-					files << file;
-				}
-				else
-					properties[attr.value().toString()] = xml.readElementText();
-			}
-		}
-		// EncryptedData/EncryptionMethod
-		else if( xml.name() == "EncryptionMethod" )
-			method = xml.attributes().value("Algorithm").toString();
-		// EncryptedData/KeyInfo/EncryptedKey
-		else if( xml.name() == "EncryptedKey" )
-		{
-			CKey key;
-			key.id = xml.attributes().value("Id").toString();
-			key.recipient = xml.attributes().value("Recipient").toString();
-			while(!xml.atEnd())
-			{
-				xml.readNext();
-				if( xml.name() == "EncryptedKey" && xml.isEndElement() )
-					break;
-				if( !xml.isStartElement() )
-					continue;
-				// EncryptedData/KeyInfo/KeyName
-				if(xml.name() == "KeyName")
-					key.name = xml.readElementText();
-				// EncryptedData/KeyInfo/EncryptedKey/EncryptionMethod
-				else if(xml.name() == "EncryptionMethod")
-					key.method = xml.attributes().value("Algorithm").toString();
-				// EncryptedData/KeyInfo/EncryptedKey/KeyInfo/AgreementMethod
-				else if(xml.name() == "AgreementMethod")
-					key.agreement = xml.attributes().value("Algorithm").toString();
-				// EncryptedData/KeyInfo/EncryptedKey/KeyInfo/AgreementMethod/KeyDerivationMethod
-				else if(xml.name() == "KeyDerivationMethod")
-					key.derive = xml.attributes().value("Algorithm").toString();
-				// EncryptedData/KeyInfo/EncryptedKey/KeyInfo/AgreementMethod/KeyDerivationMethod/ConcatKDFParams
-				else if(xml.name() == "ConcatKDFParams")
-				{
-					key.AlgorithmID = QByteArray::fromHex(xml.attributes().value("AlgorithmID").toUtf8());
-					if(key.AlgorithmID[0] == char(0x00)) key.AlgorithmID.remove(0, 1);
-					key.PartyUInfo = QByteArray::fromHex(xml.attributes().value("PartyUInfo").toUtf8());
-					if(key.PartyUInfo[0] == char(0x00)) key.PartyUInfo.remove(0, 1);
-					key.PartyVInfo = QByteArray::fromHex(xml.attributes().value("PartyVInfo").toUtf8());
-					if(key.PartyVInfo[0] == char(0x00)) key.PartyVInfo.remove(0, 1);
-				}
-				// EncryptedData/KeyInfo/EncryptedKey/KeyInfo/AgreementMethod/KeyDerivationMethod/ConcatKDFParams/DigestMethod
-				else if(xml.name() == "DigestMethod")
-					key.concatDigest = xml.attributes().value("Algorithm").toString();
-				// EncryptedData/KeyInfo/EncryptedKey/KeyInfo/AgreementMethod/OriginatorKeyInfo/KeyValue/ECKeyValue/PublicKey
-				else if(xml.name() == "PublicKey")
-				{
-					xml.readNext();
-					key.publicKey = fromBase64(xml.text());
-				}
-				// EncryptedData/KeyInfo/EncryptedKey/KeyInfo/X509Data/X509Certificate
-				else if(xml.name() == "X509Certificate")
-				{
-					xml.readNext();
-					key.cert = QSslCertificate( fromBase64( xml.text() ), QSsl::Der );
-				}
-				// EncryptedData/KeyInfo/EncryptedKey/KeyInfo/CipherData/CipherValue
-				else if(xml.name() == "CipherValue")
-				{
-					xml.readNext();
-					key.cipher = fromBase64(xml.text());
-				}
-			}
-			keys << key;
-		}
-	}
-	return QByteArray();
-}
-
-void CryptoDocPrivate::writeCDoc(QIODevice *cdoc, const QByteArray &transportKey,
-	const QByteArray &encryptedData, const QString &file, const QString &ver, const QString &mime)
-{
-#ifndef NDEBUG
-	qDebug() << "ENC Transport Key" << transportKey.toHex();
-#endif
-
-	qCDebug(CRYPTO) << "Writing CDOC file ver" << ver << "mime" << mime;
-	QMultiHash<QString,QString> props;
-	props.insert("DocumentFormat", "ENCDOC-XML|" + ver);
-	props.insert("LibraryVersion", qApp->applicationName() + "|" + qApp->applicationVersion());
-	props.insert("Filename", file);
-	QList<File> reverse = files;
-	std::reverse(reverse.begin(), reverse.end());
-	for(const File &file: qAsConst(reverse))
-		props.insert("orig_file", QString("%1|%2|%3|%4").arg(file.name).arg(file.data.size()).arg(file.mime).arg(file.id));
-
-	QXmlStreamWriter w(cdoc);
-	w.setAutoFormatting(true);
-	w.writeStartDocument();
-	w.writeNamespace(DENC, "denc");
-	writeElement(w, DENC, "EncryptedData", [&]{
-		if(!mime.isEmpty())
-			w.writeAttribute("MimeType", mime);
-		writeElement(w, DENC, "EncryptionMethod", {{"Algorithm", method}});
-		w.writeNamespace(DS, "ds");
-		writeElement(w, DS, "KeyInfo", [&]{
-		for(const CKey &k: qAsConst(keys))
-		{
-			writeElement(w, DENC, "EncryptedKey", [&]{
-				if(!k.id.isEmpty())
-					w.writeAttribute("Id", k.id);
-				if(!k.recipient.isEmpty())
-					w.writeAttribute("Recipient", k.recipient);
-				QByteArray cipher;
-				if (k.cert.publicKey().algorithm() == QSsl::Rsa)
-				{
-					RSA *rsa = static_cast<RSA*>(k.cert.publicKey().handle());
-					cipher.resize(RSA_size(rsa));
-					if(opensslError(RSA_public_encrypt(transportKey.size(), pcuchar(transportKey.constData()),
-						puchar(cipher.data()), rsa, RSA_PKCS1_PADDING) <= 0))
-						return;
-					writeElement(w, DENC, "EncryptionMethod", {{"Algorithm", RSA_MTH}});
-					writeElement(w, DS, "KeyInfo", [&]{
-						if(!k.name.isEmpty())
-							w.writeTextElement(DS, "KeyName", k.name);
-						writeElement(w, DS, "X509Data", [&]{
-							writeBase64Element(w, DS, "X509Certificate", k.cert.toDer());
-						});
-					});
-				}
-				else
-				{
-					QByteArray derCert = k.cert.toDer();
-					pcuchar pp = pcuchar(derCert.data());
-					SCOPE(X509, peerCert, d2i_X509(nullptr, &pp, derCert.size()));
-					SCOPE(EVP_PKEY, peerPKey, X509_get_pubkey(peerCert.get()));
-					SCOPE(EC_KEY, peerECKey, EVP_PKEY_get1_EC_KEY(peerPKey.get()));
-					int curve = EC_GROUP_get_curve_name(EC_KEY_get0_group(peerECKey.get()));
-					SCOPE(EC_KEY, priv, EC_KEY_new_by_curve_name(curve));
-					SCOPE(EVP_PKEY, pkey, EVP_PKEY_new());
-					if (opensslError(EC_KEY_generate_key(priv.get()) <= 0) ||
-						opensslError(EVP_PKEY_set1_EC_KEY(pkey.get(), priv.get()) <= 0))
-						return;
-					SCOPE(EVP_PKEY_CTX, ctx, EVP_PKEY_CTX_new(pkey.get(), nullptr));
-					size_t sharedSecretLen = 0;
-					if (opensslError(!ctx) ||
-						opensslError(EVP_PKEY_derive_init(ctx.get()) <= 0) ||
-						opensslError(EVP_PKEY_derive_set_peer(ctx.get(), peerPKey.get()) <= 0) ||
-						opensslError(EVP_PKEY_derive(ctx.get(), nullptr, &sharedSecretLen) <= 0))
-						return;
-					QByteArray sharedSecret(int(sharedSecretLen), 0);
-					if(opensslError(EVP_PKEY_derive(ctx.get(), puchar(sharedSecret.data()), &sharedSecretLen) <= 0))
-						return;
-
-					QByteArray oid(50, 0);
-					oid.resize(OBJ_obj2txt(oid.data(), oid.size(), OBJ_nid2obj(EC_GROUP_get_curve_name(EC_KEY_get0_group(priv.get()))), 1));
-					QByteArray SsDer(i2d_PublicKey(pkey.get(), nullptr), 0);
-					puchar p = puchar(SsDer.data());
-					i2d_PublicKey(pkey.get(), &p);
-
-					const QString encryptionMethod = KWAES256_MTH;
-					QString concatDigest = SHA384_MTH;
-					switch((SsDer.size() - 1) / 2) {
-					case 32: concatDigest = SHA256_MTH; break;
-					case 48: concatDigest = SHA384_MTH; break;
-					default: concatDigest = SHA512_MTH; break;
-					}
-					QByteArray encryptionKey = CryptoDoc::concatKDF(CryptoDocPrivate::SHA_MTH[concatDigest], KWAES_SIZE[encryptionMethod],
-						sharedSecret, props.value("DocumentFormat").toUtf8() + SsDer + k.cert.toDer());
-#ifndef NDEBUG
-					qDebug() << "ENC Ss" << SsDer.toHex();
-					qDebug() << "ENC Ksr" << sharedSecret.toHex();
-					qDebug() << "ENC ConcatKDF" << encryptionKey.toHex();
-#endif
-
-					cipher = AES_wrap(encryptionKey, transportKey, true);
-					if(opensslError(cipher.isEmpty()))
-						return;
-
-					writeElement(w, DENC, "EncryptionMethod", {{"Algorithm", encryptionMethod}});
-					writeElement(w, DS, "KeyInfo", [&]{
-						writeElement(w, DENC, "AgreementMethod", {{"Algorithm", AGREEMENT_MTH}}, [&]{
-							w.writeNamespace(XENC11, "xenc11");
-							writeElement(w, XENC11, "KeyDerivationMethod", {{"Algorithm", CONCATKDF_MTH}}, [&]{
-								writeElement(w, XENC11, "ConcatKDFParams", {{"AlgorithmID", "00" + props.value("DocumentFormat").toUtf8().toHex()},
-									{"PartyUInfo", "00" + SsDer.toHex()}, {"PartyVInfo", "00" + k.cert.toDer().toHex()}
-								}, [&]{
-									writeElement(w, DS, "DigestMethod", {{"Algorithm", concatDigest}});
-								});
-							});
-							writeElement(w, DENC, "OriginatorKeyInfo", [&]{
-								writeElement(w, DS, "KeyValue", [&]{
-									w.writeNamespace(DSIG11, "dsig11");
-									writeElement(w, DSIG11, "ECKeyValue", [&]{
-										writeElement(w, DSIG11, "NamedCurve", {{"URI", "urn:oid:" + oid}});
-										writeBase64Element(w, DSIG11, "PublicKey", SsDer);
-									});
-								});
-							});
-							writeElement(w, DENC, "RecipientKeyInfo", [&]{
-								writeElement(w, DS, "X509Data", [&]{
-									writeBase64Element(w, DS, "X509Certificate", k.cert.toDer());
-								});
-							});
-						});
-					});
-				}
-				writeElement(w, DENC, "CipherData", [&]{
-					writeBase64Element(w, DENC, "CipherValue", cipher);
-				});
-			});
-		}});
-		writeElement(w,DENC, "CipherData", [&]{
-			writeBase64Element(w, DENC, "CipherValue", encryptedData);
-		});
-		writeElement(w, DENC, "EncryptionProperties", [&]{
-			for(QHash<QString,QString>::const_iterator i = props.constBegin(); i != props.constEnd(); ++i)
-				writeElement(w, DENC, "EncryptionProperty", {{"Name", i.key()}}, [&]{ w.writeCharacters(i.value()); });
-		});
-	});
-	w.writeEndDocument();
-}
-
-void CryptoDocPrivate::readDDoc(QIODevice *ddoc)
-{
-	qCDebug(CRYPTO) << "Parsing DDOC container";
-	files.clear();
-	QXmlStreamReader x(ddoc);
-	while(!x.atEnd())
-	{
-		if(!x.readNextStartElement())
-			continue;
-		if(x.name() == "DataFile")
-		{
-			File file;
-			file.name = x.attributes().value("Filename").toString().normalized(QString::NormalizationForm_C);
-			file.id = x.attributes().value("Id").toString().normalized(QString::NormalizationForm_C);
-			file.mime = x.attributes().value("MimeType").toString().normalized(QString::NormalizationForm_C);
-			x.readNext();
-			file.data = fromBase64( x.text() );
-			file.size = FileDialog::fileSize(quint64(file.data.size()));
-			files << file;
-		}
-		else if(x.name() == "Signature")
-			hasSignature = true;
-	}
-	qCDebug(CRYPTO) << "Container contains signature" << hasSignature;
-}
-
-void CryptoDocPrivate::writeDDoc(QIODevice *ddoc)
-{
-	qCDebug(CRYPTO) << "Creating DDOC container";
-	QXmlStreamWriter x(ddoc);
-	x.setAutoFormatting(true);
-	x.writeStartDocument();
-	x.writeDefaultNamespace("http://www.sk.ee/DigiDoc/v1.3.0#");
-	x.writeStartElement("SignedDoc");
-	writeAttributes(x, {{"format", "DIGIDOC-XML"}, {"version", "1.3"}});
-
-	for(const File &file: qAsConst(files))
-	{
-		x.writeStartElement("DataFile");
-		writeAttributes(x, {{"ContentType", "EMBEDDED_BASE64"}, {"Filename", file.name},
-			{"Id", file.id}, {"MimeType", file.mime}, {"Size", QString::number(file.data.size())}});
-		x.writeDefaultNamespace("http://www.sk.ee/DigiDoc/v1.3.0#");
-		writeBase64(x, file.data);
-		x.writeEndElement(); //DataFile
-	}
-
-	x.writeEndElement(); //SignedDoc
-	x.writeEndDocument();
-}
-
-
-
 CDocumentModel::CDocumentModel( CryptoDocPrivate *doc )
 :	QAbstractTableModel( doc )
 ,	d( doc )
@@ -778,19 +132,11 @@ CDocumentModel::CDocumentModel( CryptoDocPrivate *doc )
 
 void CDocumentModel::addFile( const QString &file, const QString &mime )
 {
-	if( d->isEncryptedWarning() )
+	if( d->isBusyWarning() || d->isEncryptedWarning() )
 		return;
 
 	emit beginInsertRows(QModelIndex(), d->files.size(), 1);
-	QFile data(file);
-	data.open(QFile::ReadOnly);
-	CryptoDocPrivate::File f;
-	f.id = QString("D%1").arg(d->files.size());
-	f.mime = mime;
-	f.name = QFileInfo(file).fileName();
-	f.data = data.readAll();
-	f.size = FileDialog::fileSize(quint64(f.data.size()));
-	d->files << f;
+	d->addFile(file, mime);
 	emit endInsertRows();
 }
 
@@ -803,8 +149,7 @@ QString CDocumentModel::copy( const QModelIndex &index, const QString &dst ) con
 	if( QFile::exists( dst ) )
 		QFile::remove( dst );
 
-	QFile f(dst);
-	if(!f.open(QFile::WriteOnly) || f.write(row.data) < 0)
+	if(!row.save(dst))
 	{
 		d->setLastError( tr("Failed to save file '%1'").arg( dst ) );
 		return QString();
@@ -830,7 +175,7 @@ QVariant CDocumentModel::data( const QModelIndex &index, int role ) const
 		{
 		case Name: return f.name;
 		case Mime: return f.mime;
-		case Size: return f.size;
+		case Size: return d->size(f);
 		default: return QVariant();
 		}
 	case Qt::TextAlignmentRole:
@@ -847,7 +192,7 @@ QVariant CDocumentModel::data( const QModelIndex &index, int role ) const
 		case Save: return tr("Save");
 		case Remove: return tr("Remove");
 		default: return tr("Filename: %1\nFilesize: %2\nMedia type: %3")
-			.arg( f.name, f.size, f.mime );
+			.arg( f.name, d->size(f), f.mime );
 		}
 	case Qt::DecorationRole:
 		switch( index.column() )
@@ -918,7 +263,7 @@ void CDocumentModel::open( const QModelIndex &index )
 
 bool CDocumentModel::removeRows( int row, int count, const QModelIndex &parent )
 {
-	if( parent.isValid() || d->isEncryptedWarning() )
+	if( parent.isValid() || d->isBusyWarning() || d->isEncryptedWarning() )
 		return false;
 
 	if( d->files.isEmpty() || row >= d->files.size() )
@@ -947,6 +292,7 @@ Qt::DropActions CDocumentModel::supportedDragActions() const
 void CKey::setCert( const QSslCertificate &c )
 {
 	cert = c;
+	CDocKey::setCert(c.toDer());
 	recipient = SslCertificate(c).friendlyName();
 }
 
@@ -957,170 +303,416 @@ CryptoDoc::CryptoDoc( QObject *parent )
 ,	d( new CryptoDocPrivate )
 {
 	d->documents = new CDocumentModel( d );
+	// Worker thread has finished, completion is handled on owner thread
+	connect( d, &QThread::finished, this, [this]{ finish(); } );
 }
 
-CryptoDoc::~CryptoDoc() { clear(); delete d; }
+CryptoDoc::~CryptoDoc()
+{
+	d->future.cancel();
+	d->wait();
+	d->job.reset();
+	clear();
+	delete d;
+}
 
 bool CryptoDoc::addKey( const CKey &key )
 {
-	if( d->isEncryptedWarning() )
+	return addKeys( QList<CKey>() << key );
+}
+
+bool CryptoDoc::addKeys( const QList<CKey> &keys )
+{
+	if( d->isBusyWarning() )
 		return false;
-	if( d->keys.contains( key ) )
+	QList<CDocKey> list;
+	list.reserve( keys.size() );
+	for( const CKey &key: keys )
+		list << key;
+	// Rejected keys are reported together
+	if( !d->addKeys( list ) )
 	{
-		d->setLastError( tr("Key already exists") );
+		d->setLastError( d->lastError );
 		return false;
 	}
-	d->keys << key;
 	return true;
 }
 
 bool CryptoDoc::canDecrypt(const QSslCertificate &cert)
 {
-	for(const CKey &k: qAsConst(d->keys))
-	{
-		if(!d->ENC_MTH.contains(d->method) || k.cert != cert)
-			continue;
-		if(cert.publicKey().algorithm() == QSsl::Rsa &&
-				!k.cipher.isEmpty() &&
-				k.method == CryptoDocPrivate::RSA_MTH)
-			return true;
-		if(cert.publicKey().algorithm() == QSsl::Ec &&
-				!k.publicKey.isEmpty() &&
-				!k.cipher.isEmpty() &&
-				d->KWAES_SIZE.contains(k.method) &&
-				k.derive == CryptoDocPrivate::CONCATKDF_MTH &&
-				k.agreement == CryptoDocPrivate::AGREEMENT_MTH)
-			return true;
-	}
-	return false;
+	return d->canDecrypt(cert.toDer());
 }
 
-QByteArray CryptoDoc::concatKDF(QCryptographicHash::Algorithm hashAlg, quint32 keyDataLen, const QByteArray &z, const QByteArray &otherInfo)
+void CryptoDoc::clear( const QString &file )
 {
-	quint32 hashLen = 0;
-	switch(hashAlg)
-	{
-	case QCryptographicHash::Sha256: hashLen = 32; break;
-	case QCryptographicHash::Sha384: hashLen = 48; break;
-	case QCryptographicHash::Sha512: hashLen = 64; break;
-	default: return QByteArray();
-	}
-	quint32 reps = quint32(std::ceil(double(keyDataLen) / double(hashLen)));
-	QCryptographicHash md(hashAlg);
-	QByteArray key;
-	for(quint32 i = 1; i <= reps; i++)
-	{
-		quint32 intToFourBytes = qToBigEndian(i);
-		md.reset();
-		md.addData((const char*)&intToFourBytes, 4);
-		md.addData(z);
-		md.addData(otherInfo);
-		key += md.result();
-	}
-	return key.left(int(keyDataLen));
+	if( !d->isBusyWarning() )
+		d->clear(file);
 }
 
-void CryptoDoc::clear( const QString &file )
+bool CryptoDoc::decrypt()
 {
-	delete d->ddoc;
-	for(const QString &file: qAsConst(d->tempFiles))
-		QFile::remove(file);
-	d->tempFiles.clear();
-	d->ddoc = nullptr;
-	d->hasSignature = false;
-	d->encrypted = false;
-	d->fileName = file;
-	d->files.clear();
-	d->keys.clear();
-	d->properties.clear();
-	d->method.clear();
-	d->mime.clear();
+	return startDecrypt( tokenKey(), tokenAgreement(), false ).result();
 }
 
-bool CryptoDoc::decrypt()
+CKey CryptoDoc::tokenKey() const
+{
+	int id = d->findKey( qApp->signer()->tokenauth().cert().toDer() );
+	return id < 0 ? CKey() : CKey( d->keys().at( id ) );
+}
+
+CryptoDoc::KeyAgreement CryptoDoc::tokenAgreement() const
+{
+	return [this](const CKey &key) {
+		bool isECDH = key.isEC();
+		QByteArray decryptedKey;
+		while(true)
+		{
+			switch(qApp->signer()->decrypt(isECDH ? key.publicKey : key.cipher, decryptedKey,
+				key.concatDigest, CDoc::KWAES_SIZE.value(key.method), key.AlgorithmID, key.PartyUInfo, key.PartyVInfo))
+			{
+			case QSigner::DecryptOK: return decryptedKey;
+			case QSigner::PinIncorrect: break;
+			default: return QByteArray();
+			}
+		}
+	};
+}
+
+bool CryptoDoc::decrypt( const CKey &key, const KeyAgreement &agreement )
+{
+	return startDecrypt( key, agreement, false ).result();
+}
+
+QFuture<bool> CryptoDoc::decryptAsync()
+{
+	return startDecrypt( tokenKey(), tokenAgreement(), true );
+}
+
+QFuture<bool> CryptoDoc::decryptAsync( const CKey &key, const KeyAgreement &agreement )
 {
+	return startDecrypt( key, agreement, true );
+}
+
+QFuture<bool> CryptoDoc::startDecrypt( const CKey &key, const KeyAgreement &agreement, bool async )
+{
+	if( d->isBusyWarning() )
+		return finished( false );
 	if( d->fileName.isEmpty() )
 	{
 		d->setLastError( tr("Container is not open") );
-		return false;
+		return finished( false );
 	}
 	if( !d->encrypted )
-		return true;
+		return finished( true );
+	if( key.cert.isNull() )
+	{
+		d->setLastError( tr("You do not have the key to decrypt this document") );
+		return finished( false );
+	}
+
+	// Token operation stays on calling thread, failures are reported by agreement
+	QByteArray decryptedKey = agreement(key);
+	if( decryptedKey.isEmpty() )
+		return finished( false );
+	return start( openJob( key, decryptedKey ), async );
+}
+
+CDoc* CryptoDoc::openJob( const CKey &key, const QByteArray &agreement )
+{
+	// Header is parsed again, payload is not read
+	std::unique_ptr<CDoc> job( new CDoc );
+	if( !job->open( d->fileName ) || !job->unwrapKey( key, agreement ) )
+	{
+		d->setLastError( job->lastError.isEmpty() ? tr("Error parsing document") : job->lastError );
+		return nullptr;
+	}
+	return job.release();
+}
 
-	CKey key;
-	for(const CKey &k: qAsConst(d->keys))
+QStringList CryptoDoc::batch( const QStringList &files, bool recent, const std::function<QString (CryptoDocPrivate *d)> &f,
+	std::vector<std::unique_ptr<CryptoDoc>> *opened )
+{
+	QStringList errors;
+	for(int i = 0; i < files.size(); ++i)
+		errors << QString();
+	QSslCertificate cert = qApp->signer()->tokenauth().cert();
+	QByteArray der = cert.toDer();
+	bool isECDH = cert.publicKey().algorithm() == QSsl::Ec;
+
+	// Collect card-bound operations of all documents
+	std::vector<std::unique_ptr<CryptoDoc>> docs;
+	std::vector<CDocKey> keys;
+	std::vector<int> index;
+	QList<QSigner::DecryptJob> jobs;
+	for(int i = 0; i < files.size(); ++i)
 	{
-		if( qApp->signer()->tokenauth().cert() == k.cert )
+		std::unique_ptr<CryptoDoc> doc(new CryptoDoc);
+		if(!(recent ? doc->open(files[i]) : doc->d->open(files[i])))
 		{
-			key = k;
-			break;
+			errors[i] = doc->d->lastError;
+			continue;
 		}
-	}
-	if( key.cert.isNull() )
+		int id = doc->d->findKey(der);
+		CDocKey key = doc->d->keys().value(id);
+		if(id < 0)
+		{
+			qCWarning(CRYPTO) << "No key to decrypt" << files[i];
+			errors[i] = tr("You do not have the key to decrypt this document");
+			continue;
+		}
+		QSigner::DecryptJob job;
+		job.in = isECDH ? key.publicKey : key.cipher;
+		job.digest = key.concatDigest;
+		job.keySize = int(CDoc::KWAES_SIZE.value(key.method));
+		job.algorithmID = key.AlgorithmID;
+		job.partyUInfo = key.PartyUInfo;
+		job.partyVInfo = key.PartyVInfo;
+		jobs << job;
+		keys.push_back(key);
+		index.push_back(i);
+		docs.push_back(std::move(doc));
+	}
+	if(jobs.isEmpty())
+		return errors;
+
+	// Token operations are serialized in one login, payloads are independent per document
+	QSigner::ErrorCode status = QSigner::PinIncorrect;
+	while(status == QSigner::PinIncorrect)
+		status = qApp->signer()->decrypt(jobs);
+	if(status != QSigner::DecryptOK)
+	{
+		for(int i: index)
+			errors[i] = tr("Failed to decrypt document");
+		return errors;
+	}
+
+	std::vector<QString> result(docs.size());
+	parallelFor(int(docs.size()), [&](int i) {
+		CryptoDocPrivate *d = docs[size_t(i)]->d;
+		if(!d->unwrapKey(keys[size_t(i)], jobs.at(i).out))
+			result[size_t(i)] = d->lastError;
+		else
+			result[size_t(i)] = f(d);
+	});
+	for(size_t i = 0; i < docs.size(); ++i)
+		errors[index[i]] = result[i];
+	if(opened)
 	{
-		d->setLastError( tr("You do not have the key to decrypt this document") );
-		return false;
+		opened->clear();
+		opened->resize(size_t(files.size()));
+		for(size_t i = 0; i < docs.size(); ++i)
+			(*opened)[size_t(index[i])] = std::move(docs[i]);
 	}
+	return errors;
+}
+
+QStringList CryptoDoc::decryptBatch( const QStringList &files, const QString &dir )
+{
+	std::vector<std::unique_ptr<CryptoDoc>> docs;
+	QStringList errors = batch(files, true, [](CryptoDocPrivate *d) {
+		if(d->decrypt())
+			return QString();
+		qCWarning(CRYPTO) << "Failed to decrypt" << d->fileName << d->lastError;
+		return d->lastError;
+	}, &docs);
+	docs.resize(size_t(files.size()));
 
-	bool decrypted = false;
-	bool isECDH = qApp->signer()->tokenauth().cert().publicKey().algorithm() == QSsl::Ec;
-	QByteArray decryptedKey;
-	while( !decrypted )
+	// Destinations are resolved in document order before saving, document fails when any of
+	// its files would overwrite existing file or file of earlier document
+	std::vector<QStringList> targets(docs.size());
+	QSet<QString> claimed;
+	for(int i = 0; i < files.size(); ++i)
 	{
-		switch(qApp->signer()->decrypt(isECDH ? key.publicKey : key.cipher, decryptedKey,
-			key.concatDigest, d->KWAES_SIZE[key.method], key.AlgorithmID, key.PartyUInfo, key.PartyVInfo))
+		if(!errors[i].isEmpty() || !docs[size_t(i)])
+			continue;
+		CryptoDocPrivate *d = docs[size_t(i)]->d;
+		QDir target(dir.isEmpty() ? QFileInfo(d->fileName).absolutePath() : dir);
+		QStringList dsts;
+		QSet<QString> keys;
+		for(const CryptoDocPrivate::File &file: qAsConst(d->files))
 		{
-		case QSigner::DecryptOK: decrypted = true; break;
-		case QSigner::PinIncorrect: break;
-		default: return false;
+			// Name comes from document, never leave target directory
+			QString dst = target.filePath(QFileInfo(file.name).fileName());
+			QString key = QFileInfo(dst).absoluteFilePath();
+#if defined(Q_OS_WIN) || defined(Q_OS_MAC)
+			key = key.toLower();
+#endif
+			if(claimed.contains(key) || keys.contains(key) || QFile::exists(dst))
+			{
+				qCWarning(CRYPTO) << "File already exists" << dst;
+				errors[i] = tr("File already exists %1").arg(dst);
+				break;
+			}
+			keys << key;
+			dsts << dst;
 		}
+		if(!errors[i].isEmpty())
+			continue;
+		claimed += keys;
+		targets[size_t(i)] = dsts;
 	}
-	if(isECDH)
+
+	std::vector<QString> saveErrors(docs.size());
+	parallelFor(files.size(), [&](int i) {
+		if(!errors.at(i).isEmpty() || !docs[size_t(i)])
+			return;
+		CryptoDocPrivate *d = docs[size_t(i)]->d;
+		for(int j = 0; j < d->files.size(); ++j)
+		{
+			const QString &dst = targets[size_t(i)].at(j);
+			if(!d->files.at(j).save(dst))
+			{
+				qCWarning(CRYPTO) << "Failed to save file" << dst;
+				saveErrors[size_t(i)] = tr("Failed to save file %1").arg(dst);
+				return;
+			}
+		}
+	});
+	QStringList failed;
+	for(int i = 0; i < files.size(); ++i)
 	{
-#ifndef NDEBUG
-		qDebug() << "DEC Ss" << key.publicKey.toHex();
-		qDebug() << "DEC ConcatKDF" << decryptedKey.toHex();
-#endif
-		d->key = d->AES_wrap(decryptedKey, key.cipher, false);
-		d->opensslError(d->key.isEmpty());
+		if(!errors[i].isEmpty() || !saveErrors[size_t(i)].isEmpty())
+			failed << files[i];
 	}
-	else // RSA decrypts directly transport key
-		d->key = decryptedKey;
-#ifndef NDEBUG
-	qDebug() << "DEC transport" << d->key.toHex();
-#endif
+	return failed;
+}
 
-	d->waitForFinished();
-	if( !d->lastError.isEmpty() )
-		d->setLastError( d->lastError );
-	d->documents->revert();
-	return !d->encrypted;
+QStringList CryptoDoc::verifyBatch( const QStringList &files )
+{
+	return batch(files, false, [](CryptoDocPrivate *d) {
+		if(d->verify())
+			return QString();
+		qCWarning(CRYPTO) << "Failed to verify" << d->fileName << d->lastError;
+		return d->lastError;
+	});
 }
 
 CDocumentModel* CryptoDoc::documents() const { return d->documents; }
 
 bool CryptoDoc::encrypt( const QString &filename )
 {
-	if( !filename.isEmpty() )
-		d->fileName = filename;
+	return startEncrypt( filename, false ).result();
+}
+
+QFuture<bool> CryptoDoc::encryptAsync( const QString &filename )
+{
+	return startEncrypt( filename, true );
+}
+
+QFuture<bool> CryptoDoc::startRewrap( const QList<CKey> &keys, bool async )
+{
+	if( d->isBusyWarning() )
+		return finished( false );
 	if( d->fileName.isEmpty() )
 	{
 		d->setLastError( tr("Container is not open") );
-		return false;
+		return finished( false );
+	}
+	if( !d->encrypted )
+	{
+		d->setLastError( tr("Container is not encrypted") );
+		return finished( false );
+	}
+	if( keys.isEmpty() )
+	{
+		d->setLastError( tr("No keys specified") );
+		return finished( false );
+	}
+	CKey key = tokenKey();
+	if( key.cert.isNull() )
+	{
+		d->setLastError( tr("You do not have the key to decrypt this document") );
+		return finished( false );
+	}
+
+	// Transport key is unwrapped once with token, recipients are wrapped on worker thread
+	QByteArray decryptedKey = tokenAgreement()(key);
+	if( decryptedKey.isEmpty() )
+		return finished( false );
+	d->recipients.clear();
+	for( const CKey &k: keys )
+		d->recipients << k;
+	return start( openJob( key, decryptedKey ), async, true );
+}
+
+QFuture<bool> CryptoDoc::startEncrypt( const QString &filename, bool async )
+{
+	if( d->isBusyWarning() )
+		return finished( false );
+	QString file = filename.isEmpty() ? d->fileName : filename;
+	if( file.isEmpty() )
+	{
+		d->setLastError( tr("Container is not open") );
+		return finished( false );
 	}
 	if( d->encrypted )
-		return true;
-	if( d->keys.isEmpty() )
+		return finished( true );
+	if( d->keys().isEmpty() )
 	{
 		d->setLastError( tr("No keys specified") );
-		return false;
+		return finished( false );
+	}
+	std::unique_ptr<CDoc> job( new CDoc );
+	job->clear( file );
+	job->files = d->files;
+	job->addKeys( d->keys() );
+	Settings s(qApp->applicationName());
+	job->withDDoc = s.value("cdocwithddoc", false).toBool();
+	job->segmentSize = s.value("cdocSegmentSize", 0).toLongLong();
+	job->compress = s.value("cdocCompress", false).toBool();
+	return start( job.release(), async );
+}
+
+QFuture<bool> CryptoDoc::start( CDoc *job, bool async, bool rewrap )
+{
+	std::unique_ptr<CDoc> copy( job );
+	if( !copy || d->job )
+		return finished( false );
+	d->startOperation();
+	d->job = std::move( copy );
+	d->job->progress = d->progress;
+	d->result = false;
+	d->rewrapping = rewrap;
+	d->decrypting = !rewrap && d->encrypted;
+	if( async )
+		d->start();
+	else
+	{
+		d->run();
+		finish();
 	}
+	return d->future.future();
+}
 
-	d->waitForFinished();
-	if( !d->lastError.isEmpty() )
+void CryptoDoc::finish()
+{
+	// Worker has finished with job, document state is replaced only on success
+	std::unique_ptr<CDoc> job( std::move( d->job ) );
+	if( !job )
+		return;
+	bool canceled = d->future.isCanceled();
+	bool result = d->result && !canceled;
+	d->lastError = job->lastError;
+	if( !d->lastError.isEmpty() && !canceled )
 		d->setLastError( d->lastError );
-	open(d->fileName);
-	return d->encrypted;
+	if( result && (d->decrypting || d->rewrapping) )
+	{
+		d->CDoc::swap( *job );
+		d->documents->revert();
+	}
+	else if( result )
+		open( job->fileName );
+	d->future.reportResult( result );
+	d->future.reportFinished();
+}
+
+QFuture<bool> CryptoDoc::finished( bool result )
+{
+	QFutureInterface<bool> future;
+	future.reportStarted();
+	future.reportResult( result );
+	future.reportFinished();
+	return future.future();
 }
 
 QString CryptoDoc::fileName() const { return d->fileName; }
@@ -1130,50 +722,48 @@ bool CryptoDoc::isSigned() const { return d->hasSignature; }
 
 QList<CKey> CryptoDoc::keys()
 {
-	return d->keys;
+	QList<CKey> result;
+	for(const CDocKey &k: d->keys())
+		result << CKey(k);
+	return result;
 }
 
 bool CryptoDoc::open( const QString &file )
 {
-	clear(file);
-	QFile cdoc(d->fileName);
-	cdoc.open(QFile::ReadOnly);
-	d->readCDoc(&cdoc, false);
-	cdoc.close();
-
-	if(d->files.isEmpty() && d->properties.contains("Filename"))
-	{
-		CryptoDocPrivate::File f;
-		f.name = d->properties["Filename"];
-		f.mime = d->mime == CryptoDocPrivate::MIME_ZLIB ? d->properties["OriginalMimeType"] : d->mime;
-		f.size = d->size(d->properties["OriginalSize"]);
-		d->files << f;
-	}
-
-	d->encrypted = true;
+	if( d->isBusyWarning() )
+		return false;
+	bool result = d->open(file);
 	d->documents->revert();
 	qApp->addRecent( file );
-	return !d->keys.isEmpty();
+	return result;
+}
+
+bool CryptoDoc::rewrap( const QList<CKey> &keys )
+{
+	return startRewrap( keys, false ).result();
+}
+
+QFuture<bool> CryptoDoc::rewrapAsync( const QList<CKey> &keys )
+{
+	return startRewrap( keys, true );
 }
 
 void CryptoDoc::removeKey( int id )
 {
-	if( !d->isEncryptedWarning() )
-		d->keys.removeAt(id);
+	if( !d->isBusyWarning() && !d->isEncryptedWarning() )
+		d->removeKey(id);
 }
 
 bool CryptoDoc::saveDDoc( const QString &filename )
 {
-	if( !d->ddoc )
+	if( d->isBusyWarning() )
+		return false;
+	if( !d->saveDDoc( filename ) )
 	{
-		d->setLastError( tr("Document not open") );
+		d->setLastError( d->lastError );
 		return false;
 	}
-
-	bool result = d->ddoc->copy( filename );
-	if( !result )
-		d->setLastError( tr("Failed to save file") );
-	return result;
+	return true;
 }
 
 #include "CryptoDoc.moc"
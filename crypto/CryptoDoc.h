@@ -19,11 +19,18 @@
 
 #pragma once
 
+#include "CDoc.h"
+
 #include <QtCore/QAbstractTableModel>
+#include <QtCore/QFuture>
 
 #include <QtCore/QStringList>
 #include <QtNetwork/QSslCertificate>
 
+#include <functional>
+#include <memory>
+#include <vector>
+
 class CryptoDocPrivate;
 class CDocumentModel: public QAbstractTableModel
 {
@@ -63,18 +70,15 @@ private:
 	CryptoDocPrivate *d;
 };
 
-class CKey
+class CKey: public CDocKey
 {
 public:
 	CKey() {}
 	CKey( const QSslCertificate &cert ) { setCert( cert ); }
+	explicit CKey( const CDocKey &key ): CDocKey( key ), cert( key.der, QSsl::Der ) {}
 	void setCert( const QSslCertificate &cert );
-	bool operator==( const CKey &other ) const { return other.cert == cert; }
 
 	QSslCertificate cert;
-	QString id, name, recipient, method, agreement, derive, concatDigest;
-	QByteArray AlgorithmID, PartyUInfo, PartyVInfo;
-	QByteArray cipher, publicKey;
 };
 
 class CryptoDoc: public QObject
@@ -85,11 +89,21 @@ public:
 	~CryptoDoc();
 
 	bool addKey( const CKey &key );
+	bool addKeys( const QList<CKey> &keys );
 	bool canDecrypt(const QSslCertificate &cert);
 	void clear( const QString &file = QString() );
 	bool decrypt();
+	// Private key operation for key: RSA decrypted cipher or ECDH ConcatKDF derived key encryption key,
+	// empty on failure
+	typedef std::function<QByteArray (const CKey &key)> KeyAgreement;
+	bool decrypt( const CKey &key, const KeyAgreement &agreement );
+	// Key agreement runs on calling thread, payload on worker thread. Future reports progress
+	// in 0..1000 and finishes on owner thread, canceling stops at next chunk.
+	QFuture<bool> decryptAsync();
+	QFuture<bool> decryptAsync( const CKey &key, const KeyAgreement &agreement );
 	CDocumentModel* documents() const;
 	bool encrypt( const QString &filename = QString() );
+	QFuture<bool> encryptAsync( const QString &filename = QString() );
 	QString fileName() const;
 	bool isEncrypted() const;
 	bool isNull() const;
@@ -97,11 +111,33 @@ public:
 	QList<CKey> keys();
 	bool open( const QString &file );
 	void removeKey( int id );
+	// Replaces recipients of encrypted document, transport key is unwrapped with token and
+	// payload is copied without decrypting
+	bool rewrap( const QList<CKey> &keys );
+	QFuture<bool> rewrapAsync( const QList<CKey> &keys );
 	bool saveDDoc( const QString &filename );
 
-	static QByteArray concatKDF(QCryptographicHash::Algorithm hashAlg,
-		quint32 keyDataLen, const QByteArray &z, const QByteArray &otherInfo);
+	// Decrypts documents with one token login, contents are saved to dir or next to document.
+	// Returns documents that failed.
+	static QStringList decryptBatch( const QStringList &files, const QString &dir = QString() );
+	// Decrypts payloads of documents with one token login without keeping plaintext.
+	// Returns error of each document, empty when payload decrypts and verifies.
+	static QStringList verifyBatch( const QStringList &files );
 
 private:
+	// Unwraps transport keys of documents with one token login and runs f for each on all cores,
+	// returns error of each document. Processed documents are moved to opened by file index.
+	static QStringList batch( const QStringList &files, bool recent, const std::function<QString (CryptoDocPrivate *d)> &f,
+		std::vector<std::unique_ptr<CryptoDoc>> *opened = nullptr );
+	void finish();
+	static QFuture<bool> finished( bool result );
+	CDoc* openJob( const CKey &key, const QByteArray &agreement );
+	QFuture<bool> start( CDoc *job, bool async, bool rewrap = false );
+	QFuture<bool> startDecrypt( const CKey &key, const KeyAgreement &agreement, bool async );
+	QFuture<bool> startEncrypt( const QString &filename, bool async );
+	QFuture<bool> startRewrap( const QList<CKey> &keys, bool async );
+	KeyAgreement tokenAgreement() const;
+	CKey tokenKey() const;
+
 	CryptoDocPrivate *d;
 };
@@ -32,6 +32,7 @@
 #include <QtCore/QDateTime>
 #include <QtCore/QDir>
 #include <QtCore/QFile>
+#include <QtCore/QSet>
 #include <QtCore/QSettings>
 #include <QtCore/QSortFilterProxyModel>
 #include <QtCore/QStandardPaths>
@@ -469,8 +470,13 @@ void CertAddDialog::addCerts( const QList<QSslCertificate> &certs )
 {
 	if( certs.isEmpty() )
 		return;
-	bool status = false;
+	QList<CKey> keys;
 	QAbstractItemModel *m = history;
+	// Owners already in history, looked up once for whole list
+	QSet<QPair<QString,int>> known;
+	for( int i = 0; i < m->rowCount(); ++i )
+		known << qMakePair( m->index( i, HistoryModel::Owner ).data().toString(),
+			m->index( i, HistoryModel::Type ).data( Qt::EditRole ).toInt() );
 	for(const QSslCertificate &c: certs)
 	{
 		SslCertificate cert( c );
@@ -489,7 +495,7 @@ void CertAddDialog::addCerts( const QList<QSslCertificate> &certs )
 				QMessageBox::Yes|QMessageBox::No, QMessageBox::No))
 			continue;
 
-		status = std::max( status, doc->addKey( cert ) );
+		keys << CKey( cert );
 
 		HistoryModel::KeyType type = HistoryModel::IDCard;
 		switch( cert.type() )
@@ -503,18 +509,10 @@ void CertAddDialog::addCerts( const QList<QSslCertificate> &certs )
 		default: continue;
 		}
 
-		bool found = false;
-		for( int i = 0; i < m->rowCount(); ++i )
-		{
-			if( m->index( i, HistoryModel::Owner ).data().toString() == cert.subjectInfo( "CN" ) &&
-				m->index( i, HistoryModel::Type ).data( Qt::EditRole ).toInt() == type )
-			{
-				found = true;
-				break;
-			}
-		}
-		if( found )
+		QPair<QString,int> owner = qMakePair( cert.subjectInfo( "CN" ), int(type) );
+		if( known.contains( owner ) )
 			continue;
+		known << owner;
 
 		int row = m->rowCount();
 		m->insertRow( row );
@@ -525,6 +523,7 @@ void CertAddDialog::addCerts( const QList<QSslCertificate> &certs )
 	}
 	m->submit();
 
+	bool status = !keys.isEmpty() && doc->addKeys( keys );
 	Q_EMIT updateView();
 	certAddStatus->setText( status ? tr("Certs added successfully") : tr("Failed to add certs") );
 	QTimer::singleShot( 3*1000, certAddStatus, SLOT(clear()) );
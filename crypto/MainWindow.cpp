@@ -27,6 +27,8 @@
 #include <common/Settings.h>
 #include <common/TokenData.h>
 
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QFutureWatcher>
 #include <QtCore/QMimeData>
 #include <QtCore/QProcess>
 #include <QtCore/QTextStream>
@@ -36,7 +38,6 @@
 #include <QtGui/QDragEnterEvent>
 #include <QtNetwork/QSslKey>
 #include <QtWidgets/QMessageBox>
-#include <QtWidgets/QProgressBar>
 #include <QtWidgets/QProgressDialog>
 
 #if QT_VERSION < 0x050700
@@ -277,31 +278,23 @@ void MainWindow::buttonClicked( int button )
 		break;
 	case ViewCrypto:
 	{
-		QProgressDialog p( this );
-		p.setWindowFlags( (p.windowFlags() | Qt::CustomizeWindowHint) & ~Qt::WindowCloseButtonHint );
-		if( QProgressBar *bar = p.findChild<QProgressBar*>() )
-			bar->setTextVisible( false );
-		p.setCancelButton( 0 );
-		p.setRange( 0, 0 );
-
 		if( doc->isEncrypted() )
 		{
-			p.setLabelText( tr("Decrypting") );
-			p.open();
-			doc->decrypt();
-
-			if( doc->isSigned() )
-			{
-				QMessageBox::StandardButton b = QMessageBox::warning( this, windowTitle(),
-					tr("This container contains signature! Open with QDigiDocClient?"),
-					QMessageBox::Yes|QMessageBox::No, QMessageBox::Yes );
-				if( b != QMessageBox::Yes )
-					break;
-				QString file = QString( QFileInfo( doc->fileName() ).baseName() ).append( ".ddoc" );
-				file = FileDialog::getSaveFileName( this, tr("Save file"), file, tr("Documents (%1)").arg("*.DDoc") );
-				if( !file.isEmpty() && doc->saveDDoc( file ) )
-					qApp->showClient( QStringList() << file );
-			}
+			showProgress( doc->decryptAsync(), tr("Decrypting"), [this] {
+				if( doc->isSigned() )
+				{
+					QMessageBox::StandardButton b = QMessageBox::warning( this, windowTitle(),
+						tr("This container contains signature! Open with QDigiDocClient?"),
+						QMessageBox::Yes|QMessageBox::No, QMessageBox::Yes );
+					if( b != QMessageBox::Yes )
+						return;
+					QString file = QString( QFileInfo( doc->fileName() ).baseName() ).append( ".ddoc" );
+					file = FileDialog::getSaveFileName( this, tr("Save file"), file, tr("Documents (%1)").arg("*.DDoc") );
+					if( !file.isEmpty() && doc->saveDDoc( file ) )
+						qApp->showClient( QStringList() << file );
+				}
+				setCurrentPage( View );
+			});
 		}
 		else
 		{
@@ -310,8 +303,6 @@ void MainWindow::buttonClicked( int button )
 				qApp->showWarning( tr("No keys specified") );
 				break;
 			}
-			p.setLabelText( tr("Encrypting") );
-			p.open();
 			if( !FileDialog::fileIsWritable( doc->fileName() ) &&
 				QMessageBox::Yes == QMessageBox::warning( this, tr("DigiDoc3 crypto"),
 					tr("Cannot alter container %1. Save different location?")
@@ -321,13 +312,12 @@ void MainWindow::buttonClicked( int button )
 				QString file = selectFile( doc->fileName() );
 				if( !file.isEmpty() )
 				{
-					doc->encrypt( file );
+					showProgress( doc->encryptAsync( file ), tr("Encrypting"), []{} );
 					return;
 				}
 			}
-			doc->encrypt();
+			showProgress( doc->encryptAsync(), tr("Encrypting"), [this] { setCurrentPage( View ); } );
 		}
-		setCurrentPage( View );
 		break;
 	}
 	case ViewAddFile:
@@ -511,6 +501,35 @@ QString MainWindow::selectFile( const QString &filename )
 		tr("Documents (%1)").arg( "*.cdoc") );
 }
 
+void MainWindow::showProgress( const QFuture<bool> &future, const QString &label, const std::function<void ()> &done )
+{
+	QProgressDialog *p = new QProgressDialog( label, tr("Cancel"), 0, 1000, this );
+	p->setWindowFlags( (p->windowFlags() | Qt::CustomizeWindowHint) & ~Qt::WindowCloseButtonHint );
+	p->setAutoClose( false );
+	p->setAutoReset( false );
+	p->setMinimumDuration( 0 );
+
+	QFutureWatcher<bool> *watcher = new QFutureWatcher<bool>( p );
+	QElapsedTimer timer;
+	timer.start();
+	connect( watcher, &QFutureWatcher<bool>::progressValueChanged, p, [=]( int value ) {
+		p->setValue( value );
+		if( value <= 0 )
+			return;
+		// Remaining time estimated from average speed so far
+		qint64 left = timer.elapsed() * (p->maximum() - value) / value / 1000;
+		p->setLabelText( tr("%1\n%2% done, about %3 left").arg( label ).arg( value / 10 )
+			.arg( left >= 60 ? tr("%1 min").arg( (left + 59) / 60 ) : tr("%1 s").arg( left ) ) );
+	});
+	connect( p, &QProgressDialog::canceled, watcher, &QFutureWatcher<bool>::cancel );
+	connect( watcher, &QFutureWatcher<bool>::finished, this, [=] {
+		p->deleteLater();
+		done();
+	});
+	watcher->setFuture( future );
+	p->open();
+}
+
 void MainWindow::setCurrentPage( Pages page )
 {
 	stack->setCurrentIndex( page );
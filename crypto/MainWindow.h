@@ -21,6 +21,10 @@
 
 #include "ui_MainWindow.h"
 
+#include <QtCore/QFuture>
+
+#include <functional>
+
 class CKey;
 class CryptoDoc;
 
@@ -75,6 +79,8 @@ private:
 	void retranslate();
 	QString selectFile( const QString &filename );
 	void setCurrentPage( Pages page );
+	// Shows progress with percentage and ETA, done is called when future finishes
+	void showProgress( const QFuture<bool> &future, const QString &label, const std::function<void ()> &done );
 
 	QActionGroup *cardsGroup;
 	CryptoDoc	*doc;
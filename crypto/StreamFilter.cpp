@@ -0,0 +1,883 @@
+/*
+ * QDigiDocCrypto
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include "StreamFilter.h"
+
+#include <QtCore/QLoggingCategory>
+#include <QtCore/QThread>
+#include <QtCore/QtEndian>
+
+#include <openssl/crypto.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+
+#include <zlib.h>
+
+#include <atomic>
+#include <cstring>
+#include <functional>
+#include <thread>
+
+typedef uchar *puchar;
+typedef const uchar *pcuchar;
+
+Q_DECLARE_LOGGING_CATEGORY(CRYPTO)
+
+// Passes everything but the last keep bytes to f, remainder stays in tail
+static bool holdBack(QByteArray &tail, int keep, const char *data, qint64 size,
+	const std::function<bool (const char *data, qint64 size)> &f)
+{
+	qint64 process = tail.size() + size - keep;
+	if(process > 0)
+	{
+		int fromTail = int(qMin<qint64>(process, tail.size()));
+		if(fromTail > 0 && !f(tail.constData(), fromTail))
+			return false;
+		tail.remove(0, fromTail);
+		qint64 fromData = process - fromTail;
+		if(fromData > 0 && !f(data, fromData))
+			return false;
+		data += fromData;
+		size -= fromData;
+	}
+	tail.append(data, int(size));
+	return true;
+}
+
+// Element of GF(2^128) in GCM bit order, hi holds bytes 0..7
+struct GHashBlock
+{
+	quint64 hi = 0, lo = 0;
+
+	GHashBlock() {}
+	GHashBlock(quint64 h, quint64 l): hi(h), lo(l) {}
+	explicit GHashBlock(const QByteArray &b)
+		: hi(qFromBigEndian<quint64>(pcuchar(b.constData())))
+		, lo(qFromBigEndian<quint64>(pcuchar(b.constData() + 8))) {}
+	GHashBlock operator^(const GHashBlock &o) const { return GHashBlock(hi ^ o.hi, lo ^ o.lo); }
+	QByteArray toByteArray() const
+	{
+		QByteArray result(16, Qt::Uninitialized);
+		qToBigEndian(hi, puchar(result.data()));
+		qToBigEndian(lo, puchar(result.data() + 8));
+		return result;
+	}
+
+	// Bitwise multiplication of NIST SP 800-38D, used only to combine per range hashes
+	GHashBlock operator*(const GHashBlock &y) const
+	{
+		GHashBlock z, v = y;
+		for(int i = 0; i < 128; ++i)
+		{
+			if(((i < 64 ? hi >> (63 - i) : lo >> (127 - i)) & 1) != 0)
+				z = z ^ v;
+			bool carry = v.lo & 1;
+			v.lo = v.lo >> 1 | v.hi << 63;
+			v.hi >>= 1;
+			if(carry)
+				v.hi ^= Q_UINT64_C(0xE100000000000000);
+		}
+		return z;
+	}
+
+	GHashBlock pow(quint64 n) const
+	{
+		GHashBlock result(Q_UINT64_C(0x8000000000000000), 0), x = *this;
+		for(; n > 0; n >>= 1, x = x * x)
+		{
+			if(n & 1)
+				result = result * x;
+		}
+		return result;
+	}
+};
+
+// AES-CTR or AES-ECB of key size, building blocks of parallel GCM
+static const EVP_CIPHER *aesCipher(int keySize, bool ctr)
+{
+	if(ctr)
+		return keySize == 16 ? EVP_aes_128_ctr() : keySize == 24 ? EVP_aes_192_ctr() : EVP_aes_256_ctr();
+	return keySize == 16 ? EVP_aes_128_ecb() : keySize == 24 ? EVP_aes_192_ecb() : EVP_aes_256_ecb();
+}
+
+static QString opensslError()
+{
+	QString result;
+	unsigned long errorCode = 0;
+	while((errorCode = ERR_get_error()) != 0)
+	{
+		qCWarning(CRYPTO) << ERR_error_string(errorCode, 0);
+		if(result.isEmpty())
+			result = ERR_error_string(errorCode, 0);
+	}
+	return result;
+}
+
+
+
+// Threads started by parallelFor() and still running, shared by nested calls
+static std::atomic<int> activeThreads(0);
+
+void parallelFor(int count, const std::function<void (int)> &f, int threads)
+{
+	// Explicit thread count is used as is, default count only takes cores left idle by other
+	// calls, so nested calls from batch jobs run on calling thread instead of oversubscribing
+	int extra = qMin(threads > 0 ? threads : QThread::idealThreadCount(), count) - 1;
+	if(threads > 0)
+		activeThreads += qMax(0, extra);
+	else
+	{
+		int active = activeThreads;
+		int wanted = extra;
+		do
+			extra = qBound(0, wanted, QThread::idealThreadCount() - 1 - active);
+		while(!activeThreads.compare_exchange_weak(active, active + extra));
+	}
+	extra = qMax(0, extra);
+
+	std::atomic<int> next(0);
+	auto worker = [&]{
+		for(int i = next++; i < count; i = next++)
+			f(i);
+	};
+	std::vector<std::thread> pool;
+	for(int i = 0; i < extra; ++i)
+		pool.emplace_back(worker);
+	worker();
+	for(std::thread &thread: pool)
+		thread.join();
+	activeThreads -= extra;
+}
+
+
+
+const qint64 StreamFilter::CHUNK;
+
+StreamFilter::StreamFilter( QIODevice *next )
+:	n( next )
+{
+	open( QIODevice::WriteOnly );
+}
+
+bool StreamFilter::fail( const QString &error )
+{
+	failed = true;
+	setErrorString( error );
+	return false;
+}
+
+bool StreamFilter::finish()
+{
+	if(failed)
+		return false;
+	StreamFilter *filter = dynamic_cast<StreamFilter*>(n);
+	if(filter && !filter->finish())
+		return fail(filter->errorString());
+	return true;
+}
+
+bool StreamFilter::forward( const char *data, qint64 size )
+{
+	if(size <= 0)
+		return true;
+	if(n->write(data, size) != size)
+		return fail(n->errorString());
+	return true;
+}
+
+qint64 StreamFilter::readData( char *, qint64 )
+{
+	return -1;
+}
+
+
+
+bool FilterChain::finish()
+{
+	StreamFilter *filter = dynamic_cast<StreamFilter*>(h);
+	return !filter || filter->finish();
+}
+
+
+
+FunctionSink::FunctionSink( const std::function<bool (const char *data, qint64 size)> &_f )
+:	f( _f )
+{
+	open( QIODevice::WriteOnly );
+}
+
+qint64 FunctionSink::readData( char *, qint64 )
+{
+	return -1;
+}
+
+qint64 FunctionSink::writeData( const char *data, qint64 size )
+{
+	return f( data, size ) ? size : -1;
+}
+
+
+
+qint64 Base64Decoder::decodeParallel( const char *data, qint64 size )
+{
+	// Pieces start after line breaks near equal split points
+	std::vector<qint64> begin(1, 0);
+	int count = QThread::idealThreadCount();
+	for(int i = 1; i < count; ++i)
+	{
+		qint64 pos = qMax(size * i / count, begin.back());
+		const char *lf = static_cast<const char*>(memchr(data + pos, '\n', size_t(size - pos)));
+		if(!lf)
+			break;
+		if(lf - data + 1 < size && lf - data + 1 > begin.back())
+			begin.push_back(lf - data + 1);
+	}
+	if(begin.size() < 2)
+		return -1;
+	begin.push_back(size);
+
+	// Every piece is decoded to its own region of result
+	size_t pieces = begin.size() - 1;
+	std::vector<size_t> offset(pieces + 1, 0), decoded(pieces);
+	std::vector<Base64::State> states(pieces);
+	for(size_t i = 0; i < pieces; ++i)
+		offset[i + 1] = offset[i] + Base64::decodeSize(size_t(begin[i + 1] - begin[i]));
+	result.resize(int(offset.back()));
+	parallelFor(int(pieces), [&](int i) {
+		size_t p = size_t(i);
+		decoded[p] = Base64::decode(data + begin[p], size_t(begin[p + 1] - begin[p]), result.data() + offset[p], states[p]);
+	});
+
+	// Piece is decoded right only when all earlier pieces ended on quantum boundary
+	size_t used = decoded[0];
+	for(size_t i = 1; i < pieces; ++i)
+	{
+		if(states[i - 1].nbits != 0)
+			return -1;
+		memmove(result.data() + used, result.constData() + offset[i], decoded[i]);
+		used += decoded[i];
+	}
+	state = states.back();
+	return qint64(used);
+}
+
+qint64 Base64Decoder::writeData( const char *data, qint64 size )
+{
+	// Falls back to sequential decoding when pieces do not align
+	if(size >= PARALLEL && !reference && state.nbits == 0 && !memchr(data, '&', size_t(size)))
+	{
+		qint64 decoded = decodeParallel(data, size);
+		if(decoded >= 0)
+			return forward(result.constData(), decoded) ? size : -1;
+	}
+	for(qint64 i = 0; i < size; i += CHUNK)
+	{
+		const char *in = data + i;
+		qint64 len = qMin(CHUNK, size - i);
+		// Reference digits are in base64 alphabet, copy chunk without them
+		if(reference || memchr(in, '&', size_t(len)))
+		{
+			text.resize(int(len));
+			char *out = text.data();
+			for(const char *p = in, *end = in + len; p != end; ++p)
+			{
+				if(reference)
+					reference = *p != ';';
+				else if(*p == '&')
+					reference = true;
+				else
+					*out++ = *p;
+			}
+			in = text.constData();
+			len = out - text.constData();
+		}
+		result.resize(int(Base64::decodeSize(size_t(len))));
+		size_t offset = Base64::decode(in, size_t(len), result.data(), state);
+		if(!forward(result.constData(), qint64(offset)))
+			return -1;
+	}
+	return size;
+}
+
+
+
+bool Base64Encoder::finish()
+{
+	if(!tail.isEmpty())
+	{
+		char line[65];
+		if(!forward(line, qint64(Base64::encode(tail.constData(), size_t(tail.size()), line))))
+			return false;
+		tail.clear();
+	}
+	return StreamFilter::finish();
+}
+
+qint64 Base64Encoder::writeData( const char *data, qint64 size )
+{
+	qint64 total = size;
+	// Complete line started by previous write
+	if(!tail.isEmpty())
+	{
+		int len = int(qMin<qint64>(qint64(Base64::LINE) - tail.size(), size));
+		tail.append(data, len);
+		data += len;
+		size -= len;
+		if(tail.size() < int(Base64::LINE))
+			return total;
+		char line[65];
+		if(!forward(line, qint64(Base64::encode(tail.constData(), size_t(tail.size()), line))))
+			return -1;
+		tail.clear();
+	}
+
+	const qint64 block = qint64(Base64::LINE);
+	while(size >= block)
+	{
+		qint64 len = qMin(size - size % block, CHUNK / 65 * block);
+		result.resize(int(Base64::encodeSize(size_t(len))));
+		if(!forward(result.constData(), qint64(Base64::encode(data, size_t(len), result.data()))))
+			return -1;
+		data += len;
+		size -= len;
+	}
+	tail.append(data, int(size));
+	return total;
+}
+
+
+
+CipherFilter::CipherFilter( const EVP_CIPHER *_cipher, const QByteArray &_key, bool _encrypt, QIODevice *next )
+:	StreamFilter( next )
+,	cipher( _cipher )
+,	ctx( EVP_CIPHER_CTX_new() )
+,	key( _key )
+,	tagSize( EVP_CIPHER_mode(_cipher) == EVP_CIPH_GCM_MODE ? 16 : 0 )
+,	encrypt( _encrypt )
+{
+	if(!encrypt)
+		return;
+	iv.resize(EVP_CIPHER_iv_length(cipher));
+	if(RAND_bytes(puchar(iv.data()), iv.size()) <= 0 ||
+		EVP_CipherInit(ctx, cipher, pcuchar(key.constData()), pcuchar(iv.constData()), 1) <= 0)
+		fail(opensslError());
+}
+
+CipherFilter::~CipherFilter()
+{
+	EVP_CIPHER_CTX_free(ctx);
+}
+
+bool CipherFilter::finish()
+{
+	if(encrypt)
+	{
+		if(!writeIV())
+			return false;
+	}
+	else
+	{
+		if(iv.size() < EVP_CIPHER_iv_length(cipher) || tag.size() != tagSize)
+			return fail(QStringLiteral("Encrypted data is truncated"));
+		if(parallel)
+			return decryptRanges(true) && StreamFilter::finish();
+		if(tagSize > 0 && EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, tag.size(), tag.data()) <= 0)
+			return fail(opensslError());
+	}
+
+	// GCM tag and CBC padding are verified here on decrypt, nothing is valid before
+	int size = 0;
+	QByteArray result(EVP_MAX_BLOCK_LENGTH, Qt::Uninitialized);
+	if(EVP_CipherFinal(ctx, puchar(result.data()), &size) <= 0)
+	{
+		QString error = opensslError();
+		return fail(error.isEmpty() ? QStringLiteral("Failed to verify encrypted data") : error);
+	}
+	if(!forward(result.constData(), size))
+		return false;
+
+	if(encrypt && tagSize > 0)
+	{
+		tag.resize(tagSize);
+		if(EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, tag.size(), tag.data()) <= 0)
+			return fail(opensslError());
+		if(!forward(tag.constData(), tag.size()))
+			return false;
+	}
+	return StreamFilter::finish();
+}
+
+bool CipherFilter::decryptRanges( bool last )
+{
+	const bool cbc = EVP_CIPHER_mode(cipher) == EVP_CIPH_CBC_MODE;
+	// CBC keeps last block for padding check, both keep partial block until more data arrives
+	qint64 size = pending.size() - (last ? 0 : pending.size() % 16);
+	if(cbc && !last)
+		size -= 16;
+	if(size <= 0 && !last)
+		return true;
+	if(cbc && last && (size < 16 || size % 16 != 0))
+		return fail(QStringLiteral("Encrypted data is truncated"));
+	// 32 bit GCM counter starts from 2
+	if(!cbc && blocks + (size + 15) / 16 > Q_INT64_C(0xFFFFFFFE))
+		return fail(QStringLiteral("Encrypted data is too large"));
+
+	const qint64 rangeSize = qMax<qint64>(CHUNK / 16, (size / QThread::idealThreadCount() + 15) / 16 * 16);
+	const int count = int((size + rangeSize - 1) / rangeSize);
+	QByteArray out(int(size), Qt::Uninitialized);
+	std::vector<QByteArray> hashes(static_cast<size_t>(count));
+	std::atomic<bool> ok(true);
+	parallelFor(count, [&](int i) {
+		qint64 begin = i * rangeSize;
+		int len = int(qMin(rangeSize, size - begin)), outSize = 0, finalSize = 0;
+		const char *in = pending.constData() + begin;
+		std::unique_ptr<EVP_CIPHER_CTX,decltype(&EVP_CIPHER_CTX_free)> c(EVP_CIPHER_CTX_new(), EVP_CIPHER_CTX_free);
+		if(cbc)
+		{
+			// Chaining value is the cipher text block before range
+			const char *prev = i == 0 ? chain.constData() : in - 16;
+			if(!c || EVP_DecryptInit(c.get(), cipher, pcuchar(key.constData()), pcuchar(prev)) <= 0 ||
+				EVP_CIPHER_CTX_set_padding(c.get(), 0) <= 0 ||
+				EVP_DecryptUpdate(c.get(), puchar(out.data() + begin), &outSize, pcuchar(in), len) <= 0)
+				ok = false;
+			return;
+		}
+
+		// GCM is CTR keystream from counter of first block and GMAC of cipher text range
+		QByteArray counter = iv.left(12);
+		counter.resize(16);
+		qToBigEndian(quint32(2 + blocks + begin / 16), puchar(counter.data() + 12));
+		QByteArray &hash = hashes[size_t(i)];
+		hash.resize(16);
+		if(!c || EVP_DecryptInit(c.get(), aesCipher(key.size(), true), pcuchar(key.constData()), pcuchar(counter.constData())) <= 0 ||
+			EVP_DecryptUpdate(c.get(), puchar(out.data() + begin), &outSize, pcuchar(in), len) <= 0 ||
+			EVP_EncryptInit(c.get(), cipher, pcuchar(key.constData()), pcuchar(iv.constData())) <= 0 ||
+			EVP_EncryptUpdate(c.get(), nullptr, &outSize, pcuchar(in), len) <= 0 ||
+			EVP_EncryptFinal(c.get(), nullptr, &finalSize) <= 0 ||
+			EVP_CIPHER_CTX_ctrl(c.get(), EVP_CTRL_GCM_GET_TAG, 16, hash.data()) <= 0)
+			ok = false;
+	});
+	if(!ok)
+		return fail(opensslError());
+
+	if(cbc)
+	{
+		if(size > 0)
+			chain = pending.mid(int(size - 16), 16);
+	}
+	else
+	{
+		// GMAC of range is E(K,J0) ^ (GHASH(range) ^ L) * H, ranges are joined as
+		// GHASH = GHASH * H^blocks(range) ^ GHASH(range)
+		GHashBlock h(hashKey), mask(tagMask), sum(ghash);
+		for(int i = 0; i < count; ++i)
+		{
+			qint64 len = qMin(rangeSize, size - i * rangeSize);
+			GHashBlock range = GHashBlock(hashes[size_t(i)]) ^ mask ^ (GHashBlock(quint64(len) * 8, 0) * h);
+			sum = (sum * h.pow(quint64(len + 15) / 16)) ^ range;
+		}
+		ghash = sum.toByteArray();
+	}
+	blocks += size / 16;
+	processed += size;
+	pending.remove(0, int(size));
+
+	if(last && cbc)
+	{
+		int pad = uchar(out.at(out.size() - 1));
+		if(pad < 1 || pad > 16 || out.right(pad).count(char(pad)) != pad)
+			return fail(QStringLiteral("Failed to verify encrypted data"));
+		out.chop(pad);
+	}
+	if(last && !cbc)
+	{
+		GHashBlock h(hashKey);
+		QByteArray expected = (GHashBlock(tagMask) ^ GHashBlock(ghash) ^ (GHashBlock(0, quint64(processed) * 8) * h)).toByteArray();
+		if(CRYPTO_memcmp(expected.constData(), tag.constData(), 16) != 0)
+			return fail(QStringLiteral("Failed to verify encrypted data"));
+	}
+	return forward(out.constData(), out.size());
+}
+
+void CipherFilter::setParallel( bool _parallel )
+{
+	// GCM counter of ranges is derived from 96 bit IV
+	int mode = EVP_CIPHER_mode(cipher);
+	parallel = _parallel && !encrypt && EVP_CIPHER_key_length(cipher) == key.size() &&
+		(mode == EVP_CIPH_CBC_MODE || (mode == EVP_CIPH_GCM_MODE && EVP_CIPHER_iv_length(cipher) == 12));
+}
+
+bool CipherFilter::update( const char *data, qint64 size )
+{
+	if(parallel)
+	{
+		pending.append(data, int(size));
+		return decryptRanges(false);
+	}
+	for(qint64 i = 0; i < size; i += CHUNK)
+	{
+		int len = int(qMin(CHUNK, size - i)), outSize = 0;
+		QByteArray result(len + EVP_MAX_BLOCK_LENGTH, Qt::Uninitialized);
+		if(EVP_CipherUpdate(ctx, puchar(result.data()), &outSize, pcuchar(data + i), len) <= 0)
+			return fail(opensslError());
+		if(!forward(result.constData(), outSize))
+			return false;
+	}
+	return true;
+}
+
+qint64 CipherFilter::writeData( const char *data, qint64 size )
+{
+	if(encrypt)
+		return writeIV() && update(data, size) ? size : -1;
+
+	qint64 total = size;
+	// Cipher text is prefixed with IV
+	int ivSize = EVP_CIPHER_iv_length(cipher);
+	if(iv.size() < ivSize)
+	{
+		int len = int(qMin<qint64>(ivSize - iv.size(), size));
+		iv.append(data, len);
+		data += len;
+		size -= len;
+		if(iv.size() < ivSize)
+			return total;
+		if(parallel)
+		{
+			// Hash subkey H = E(K,0) and tag mask E(K,J0) of GCM
+			QByteArray in = QByteArray(16, 0) + iv.left(12) + QByteArray::fromHex("00000001");
+			QByteArray out(32, Qt::Uninitialized);
+			int outSize = 0;
+			chain = iv;
+			if(EVP_CIPHER_mode(cipher) == EVP_CIPH_GCM_MODE &&
+				(EVP_EncryptInit(ctx, aesCipher(key.size(), false), pcuchar(key.constData()), nullptr) <= 0 ||
+				EVP_CIPHER_CTX_set_padding(ctx, 0) <= 0 ||
+				EVP_EncryptUpdate(ctx, puchar(out.data()), &outSize, pcuchar(in.constData()), in.size()) <= 0))
+			{
+				fail(opensslError());
+				return -1;
+			}
+			hashKey = out.left(16);
+			tagMask = out.mid(16);
+			ghash = QByteArray(16, 0);
+		}
+		else if(EVP_CipherInit(ctx, cipher, pcuchar(key.constData()), pcuchar(iv.constData()), 0) <= 0)
+		{
+			fail(opensslError());
+			return -1;
+		}
+	}
+
+	// GCM tag is appended to cipher text
+	if(!holdBack(tag, tagSize, data, size, [&](const char *d, qint64 s) { return update(d, s); }))
+		return -1;
+	return total;
+}
+
+bool CipherFilter::writeIV()
+{
+	if(ivWritten)
+		return true;
+	ivWritten = true;
+	return forward(iv.constData(), iv.size());
+}
+
+
+
+bool PaddingFilter::finish()
+{
+	if(encrypt)
+	{
+		// add ANSIX923 padding
+		QByteArray ansix923(int(16 - (total % 16)), 0);
+		qCDebug(CRYPTO) << "Adding ANSIX923 padding size" << ansix923.size();
+		ansix923[ansix923.size() - 1] = char(ansix923.size());
+		return forward(ansix923.constData(), ansix923.size()) && StreamFilter::finish();
+	}
+
+	// remove ANSIX923 padding
+	if(!tail.isEmpty())
+	{
+		int pad = uchar(tail.at(tail.size() - 1));
+		if(pad > 0 && pad <= tail.size() && tail.mid(tail.size() - pad, pad - 1).count('\0') == pad - 1)
+		{
+			qCDebug(CRYPTO) << "Removing ANSIX923 padding size:" << pad;
+			tail.chop(pad);
+		}
+	}
+	return forward(tail.constData(), tail.size()) && StreamFilter::finish();
+}
+
+qint64 PaddingFilter::writeData( const char *data, qint64 size )
+{
+	if(encrypt)
+	{
+		total += size;
+		return forward(data, size) ? size : -1;
+	}
+	return holdBack(tail, 16, data, size, [&](const char *d, qint64 s) { return forward(d, s); }) ? size : -1;
+}
+
+
+
+InflateFilter::InflateFilter( QIODevice *next )
+:	StreamFilter( next )
+,	z( new z_stream )
+{
+	*z = z_stream();
+	if(inflateInit(z.get()) != Z_OK)
+	{
+		end = true;
+		fail(QStringLiteral("Failed to initialize zlib"));
+	}
+}
+
+InflateFilter::~InflateFilter()
+{
+	inflateEnd(z.get());
+}
+
+bool InflateFilter::finish()
+{
+	if(!end)
+		return fail(QStringLiteral("Compressed data is truncated"));
+	return StreamFilter::finish();
+}
+
+qint64 InflateFilter::writeData( const char *data, qint64 size )
+{
+	// Output is bounded to one chunk regardless of compression ratio
+	if(result.isEmpty())
+		result.resize(int(CHUNK));
+	for(qint64 i = 0; i < size && !end; i += CHUNK)
+	{
+		z->next_in = (Bytef*)data + i;
+		z->avail_in = uInt(qMin(CHUNK, size - i));
+		do
+		{
+			z->next_out = (Bytef*)result.data();
+			z->avail_out = uInt(result.size());
+			switch(inflate(z.get(), Z_NO_FLUSH))
+			{
+			case Z_STREAM_END: end = true; break;
+			case Z_OK:
+			case Z_BUF_ERROR: break;
+			default:
+				fail(QStringLiteral("Failed to decompress data: %1").arg(z->msg));
+				return -1;
+			}
+			if(!forward(result.constData(), result.size() - z->avail_out))
+				return -1;
+		} while(z->avail_out == 0 && !end);
+	}
+	return size;
+}
+
+
+
+DeflateFilter::DeflateFilter( int level, QIODevice *next )
+:	StreamFilter( next )
+,	z( new z_stream )
+{
+	*z = z_stream();
+	initialized = deflateInit(z.get(), level) == Z_OK;
+	if(!initialized)
+		fail(QStringLiteral("Failed to initialize zlib"));
+}
+
+DeflateFilter::~DeflateFilter()
+{
+	if(initialized)
+		deflateEnd(z.get());
+}
+
+bool DeflateFilter::deflate( int flush )
+{
+	if(result.isEmpty())
+		result.resize(int(CHUNK));
+	int err = Z_OK;
+	do
+	{
+		z->next_out = (Bytef*)result.data();
+		z->avail_out = uInt(result.size());
+		err = ::deflate(z.get(), flush);
+		if(err == Z_STREAM_ERROR)
+			return fail(QStringLiteral("Failed to compress data: %1").arg(z->msg));
+		if(!forward(result.constData(), result.size() - z->avail_out))
+			return false;
+	} while(z->avail_out == 0 || (flush == Z_FINISH && err != Z_STREAM_END));
+	return true;
+}
+
+bool DeflateFilter::finish()
+{
+	if(!initialized || !deflate(Z_FINISH))
+		return false;
+	return StreamFilter::finish();
+}
+
+qint64 DeflateFilter::writeData( const char *data, qint64 size )
+{
+	if(!initialized)
+		return -1;
+	for(qint64 i = 0; i < size; i += CHUNK)
+	{
+		z->next_in = (Bytef*)data + i;
+		z->avail_in = uInt(qMin(CHUNK, size - i));
+		if(!deflate(Z_NO_FLUSH))
+			return -1;
+	}
+	t += size;
+	return size;
+}
+
+
+
+const int SegmentFilter::TAG;
+const qint64 SegmentFilter::MIN_SEGMENT;
+const qint64 SegmentFilter::MAX_SEGMENT;
+const qint64 SegmentFilter::MAX_SEGMENTS;
+
+SegmentFilter::SegmentFilter( const EVP_CIPHER *_cipher, const QByteArray &_key, bool _encrypt, qint64 _segmentSize, QIODevice *next )
+:	StreamFilter( next )
+,	cipher( _cipher )
+,	key( _key )
+,	segmentSize( _segmentSize )
+,	encrypt( _encrypt )
+{
+	if(EVP_CIPHER_mode(cipher) != EVP_CIPH_GCM_MODE || segmentSize < MIN_SEGMENT || segmentSize > MAX_SEGMENT)
+	{
+		segmentSize = 0;
+		fail(QStringLiteral("Unsupported payload segment parameters"));
+		return;
+	}
+	if(!encrypt)
+		return;
+	iv.resize(EVP_CIPHER_iv_length(cipher));
+	if(RAND_bytes(puchar(iv.data()), iv.size()) <= 0)
+		fail(opensslError());
+}
+
+bool SegmentFilter::finish()
+{
+	if(segmentSize <= 0 || !writeIV())
+		return false;
+	if(!encrypt && (iv.size() < EVP_CIPHER_iv_length(cipher) || buf.isEmpty()))
+		return fail(QStringLiteral("Encrypted data is truncated"));
+	return process(true) && StreamFilter::finish();
+}
+
+bool SegmentFilter::process( bool last )
+{
+	const qint64 inSize = encrypt ? segmentSize : segmentSize + TAG;
+	// Without last flag the final segment is held back, it may be followed by more data
+	qint64 count = last ? (buf.size() + inSize - 1) / inSize : (buf.size() - 1) / inSize;
+	if(last && count == 0)
+		count = 1;
+	if(count <= 0)
+		return true;
+	if(index + count > MAX_SEGMENTS)
+		return fail(QStringLiteral("Too many payload segments"));
+
+	std::vector<QByteArray> out(static_cast<size_t>(count));
+	std::vector<QString> errors(static_cast<size_t>(count));
+	parallelFor(int(count), [&](int i) {
+		const char *data = buf.constData() + i * inSize;
+		int len = int(qMin<qint64>(inSize, buf.size() - i * inSize));
+		QByteArray &result = out[size_t(i)];
+		// Nonce is IV with segment index XORed into bytes 7..10 and last segment flag into byte 11
+		QByteArray nonce = iv;
+		quint32 n = quint32(index + i);
+		for(int b = 0; b < 4; ++b)
+			nonce[7 + b] = char(nonce[7 + b] ^ char(n >> (24 - 8 * b)));
+		if(last && i == count - 1)
+			nonce[11] = char(nonce[11] ^ 1);
+		if(!encrypt && len < TAG)
+		{
+			errors[size_t(i)] = QStringLiteral("Encrypted data is truncated");
+			return;
+		}
+
+		std::unique_ptr<EVP_CIPHER_CTX,decltype(&EVP_CIPHER_CTX_free)> ctx(EVP_CIPHER_CTX_new(), EVP_CIPHER_CTX_free);
+		int dataSize = encrypt ? len : len - TAG, outSize = 0, finalSize = 0;
+		result.resize(dataSize + TAG);
+		if(!ctx ||
+			EVP_CipherInit(ctx.get(), cipher, pcuchar(key.constData()), pcuchar(nonce.constData()), encrypt) <= 0 ||
+			(!encrypt && EVP_CIPHER_CTX_ctrl(ctx.get(), EVP_CTRL_GCM_SET_TAG, TAG, const_cast<char*>(data + dataSize)) <= 0) ||
+			EVP_CipherUpdate(ctx.get(), puchar(result.data()), &outSize, pcuchar(data), dataSize) <= 0 ||
+			EVP_CipherFinal(ctx.get(), puchar(result.data() + outSize), &finalSize) <= 0 ||
+			(encrypt && EVP_CIPHER_CTX_ctrl(ctx.get(), EVP_CTRL_GCM_GET_TAG, TAG, result.data() + outSize + finalSize) <= 0))
+		{
+			QString error = opensslError();
+			errors[size_t(i)] = error.isEmpty() ? QStringLiteral("Failed to verify encrypted data") : error;
+			return;
+		}
+		result.resize(outSize + finalSize + (encrypt ? TAG : 0));
+	});
+
+	// Segments are verified independently, everything before first failed one is valid
+	for(qint64 i = 0; i < count; ++i)
+	{
+		if(!errors[size_t(i)].isEmpty())
+			return fail(errors[size_t(i)]);
+		if(!forward(out[size_t(i)].constData(), out[size_t(i)].size()))
+			return false;
+	}
+	buf.remove(0, int(qMin<qint64>(buf.size(), count * inSize)));
+	index += count;
+	return true;
+}
+
+qint64 SegmentFilter::writeData( const char *data, qint64 size )
+{
+	if(segmentSize <= 0)
+		return -1;
+	qint64 total = size;
+	if(!encrypt && iv.size() < EVP_CIPHER_iv_length(cipher))
+	{
+		int len = int(qMin<qint64>(EVP_CIPHER_iv_length(cipher) - iv.size(), size));
+		iv.append(data, len);
+		data += len;
+		size -= len;
+	}
+	if(!writeIV())
+		return -1;
+	// Process batches of segments for all cores, memory stays bounded by batch size
+	const qint64 inSize = encrypt ? segmentSize : segmentSize + TAG;
+	const qint64 batch = inSize * qBound<qint64>(1, QThread::idealThreadCount(), (256 << 20) / inSize);
+	while(size > 0)
+	{
+		qint64 len = qMin(size, batch - buf.size() + 1);
+		buf.append(data, int(len));
+		data += len;
+		size -= len;
+		if(buf.size() > batch && !process(false))
+			return -1;
+	}
+	return total;
+}
+
+bool SegmentFilter::writeIV()
+{
+	if(!encrypt || ivWritten)
+		return true;
+	ivWritten = true;
+	return forward(iv.constData(), iv.size());
+}
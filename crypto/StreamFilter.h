@@ -0,0 +1,239 @@
+/*
+ * QDigiDocCrypto
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#pragma once
+
+#include "Base64.h"
+
+#include <QtCore/QIODevice>
+
+#include <functional>
+#include <memory>
+#include <vector>
+
+typedef struct evp_cipher_st EVP_CIPHER;
+typedef struct evp_cipher_ctx_st EVP_CIPHER_CTX;
+typedef struct z_stream_s z_stream;
+
+// Calls f(i) for every i in [0, count) using up to threads, by default idealThreadCount(), threads.
+// Default thread count is shared with running calls, nested calls do not oversubscribe cores.
+void parallelFor( int count, const std::function<void (int)> &f, int threads = 0 );
+
+// Write-only device passing transformed data to next device, call finish() on chain head after last write
+class StreamFilter: public QIODevice
+{
+public:
+	explicit StreamFilter( QIODevice *next );
+
+	virtual bool finish();
+	bool isSequential() const override { return true; }
+	QIODevice* next() const { return n; }
+
+	static const qint64 CHUNK = 1024 * 1024;
+	// Writes of at least this size are split over all cores by filters that support it
+	static const qint64 PARALLEL = 8 * CHUNK;
+
+protected:
+	bool fail( const QString &error );
+	bool forward( const char *data, qint64 size );
+	qint64 readData( char *data, qint64 maxSize ) override;
+
+private:
+	QIODevice *n;
+	bool failed = false;
+};
+
+// Owns filters, data is written to the last appended filter
+class FilterChain
+{
+public:
+	explicit FilterChain( QIODevice *sink ): h( sink ) {}
+
+	void append( StreamFilter *filter ) { filters.emplace_back( filter ); h = filter; }
+	bool finish();
+	QIODevice* head() const { return h; }
+	bool write( const char *data, qint64 size ) { return h->write( data, size ) == size; }
+
+private:
+	std::vector<std::unique_ptr<StreamFilter>> filters;
+	QIODevice *h;
+};
+
+// Write-only device passing data to function, last device of chain
+class FunctionSink: public QIODevice
+{
+public:
+	explicit FunctionSink( const std::function<bool (const char *data, qint64 size)> &f );
+
+	bool isSequential() const override { return true; }
+
+protected:
+	qint64 readData( char *data, qint64 maxSize ) override;
+	qint64 writeData( const char *data, qint64 size ) override;
+
+private:
+	std::function<bool (const char *data, qint64 size)> f;
+};
+
+// Skips line breaks and character references (&#13;) of XML text
+class Base64Decoder: public StreamFilter
+{
+public:
+	explicit Base64Decoder( QIODevice *next ): StreamFilter( next ) {}
+
+protected:
+	qint64 writeData( const char *data, qint64 size ) override;
+
+private:
+	// Decoded size in result, -1 when data does not split on quantum boundaries
+	qint64 decodeParallel( const char *data, qint64 size );
+
+	QByteArray result, text;
+	Base64::State state;
+	bool reference = false;
+};
+
+// Line wrapped base64 as written by CDOC and DDOC, 64 characters per line
+class Base64Encoder: public StreamFilter
+{
+public:
+	explicit Base64Encoder( QIODevice *next ): StreamFilter( next ) {}
+
+	bool finish() override;
+
+protected:
+	qint64 writeData( const char *data, qint64 size ) override;
+
+private:
+	QByteArray result, tail;
+};
+
+class CipherFilter: public StreamFilter
+{
+public:
+	CipherFilter( const EVP_CIPHER *cipher, const QByteArray &key, bool encrypt, QIODevice *next );
+	~CipherFilter();
+
+	bool finish() override;
+	// Decrypts AES-CBC and AES-GCM in block aligned ranges on all cores, set before first write
+	void setParallel( bool parallel );
+
+protected:
+	qint64 writeData( const char *data, qint64 size ) override;
+
+private:
+	bool decryptRanges( bool last );
+	bool update( const char *data, qint64 size );
+	bool writeIV();
+
+	const EVP_CIPHER *cipher;
+	EVP_CIPHER_CTX *ctx;
+	QByteArray key, iv, tag;
+	int tagSize = 0;
+	bool encrypt, ivWritten = false;
+	// State of parallel decryption: unprocessed input, CBC chaining block, GCM hash subkey,
+	// encrypted initial counter and GHASH of processed cipher text
+	QByteArray pending, chain, hashKey, tagMask, ghash;
+	qint64 blocks = 0, processed = 0;
+	bool parallel = false;
+};
+
+class PaddingFilter: public StreamFilter
+{
+public:
+	PaddingFilter( bool _encrypt, QIODevice *next ): StreamFilter( next ), encrypt( _encrypt ) {}
+
+	bool finish() override;
+
+protected:
+	qint64 writeData( const char *data, qint64 size ) override;
+
+private:
+	QByteArray tail;
+	qint64 total = 0;
+	bool encrypt;
+};
+
+class InflateFilter: public StreamFilter
+{
+public:
+	explicit InflateFilter( QIODevice *next );
+	~InflateFilter();
+
+	bool finish() override;
+
+protected:
+	qint64 writeData( const char *data, qint64 size ) override;
+
+private:
+	std::unique_ptr<z_stream> z;
+	QByteArray result;
+	bool end = false;
+};
+
+// zlib stream as expected by InflateFilter, compressed in bounded output buffer
+class DeflateFilter: public StreamFilter
+{
+public:
+	DeflateFilter( int level, QIODevice *next );
+	~DeflateFilter();
+
+	bool finish() override;
+	// Uncompressed bytes written
+	qint64 total() const { return t; }
+
+protected:
+	qint64 writeData( const char *data, qint64 size ) override;
+
+private:
+	bool deflate( int flush );
+
+	std::unique_ptr<z_stream> z;
+	QByteArray result;
+	qint64 t = 0;
+	bool initialized = false;
+};
+
+// AES-GCM in independently authenticated segments of plaintext, written as IV followed by
+// ciphertext and tag of every segment. Batches of segments are processed on all cores.
+class SegmentFilter: public StreamFilter
+{
+public:
+	SegmentFilter( const EVP_CIPHER *cipher, const QByteArray &key, bool encrypt, qint64 segmentSize, QIODevice *next );
+
+	bool finish() override;
+
+	static const int TAG = 16;
+	static const qint64 MIN_SEGMENT = 4 * 1024;
+	static const qint64 MAX_SEGMENT = 64 * 1024 * 1024;
+	// Segment index is 32 bits of nonce, more segments would reuse nonces
+	static const qint64 MAX_SEGMENTS = Q_INT64_C(1) << 32;
+
+protected:
+	qint64 writeData( const char *data, qint64 size ) override;
+
+private:
+	bool process( bool last );
+	bool writeIV();
+
+	const EVP_CIPHER *cipher;
+	QByteArray key, iv, buf;
+	qint64 segmentSize, index = 0;
+	bool encrypt, ivWritten = false;
+};
@@ -0,0 +1,143 @@
+/*
+ * QDigiDocCrypto
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include "TempFile.h"
+
+#include <QtCore/QDir>
+#include <QtCore/QTemporaryFile>
+
+#ifdef Q_OS_LINUX
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+TempFile::TempFile( qint64 limit )
+:	limit( limit )
+{}
+
+TempFile::~TempFile()
+{
+	close();
+}
+
+void TempFile::close()
+{
+	QIODevice::close();
+	delete file;
+	file = nullptr;
+	memory = false;
+}
+
+QString TempFile::fileName() const
+{
+	if( !file )
+		return QString();
+	// Memory file has no name, path of descriptor opens same file
+	return memory ? QString("/proc/self/fd/%1").arg( file->handle() ) : file->fileName();
+}
+
+bool TempFile::flush()
+{
+	return file && file->flush();
+}
+
+bool TempFile::open( OpenMode mode )
+{
+	close();
+#if defined(Q_OS_LINUX) && defined(MFD_CLOEXEC)
+	int fd = memfd_create( "cdoc", MFD_CLOEXEC );
+	// Copies of file keep permissions of source, same as temporary file
+	if( fd >= 0 && fchmod( fd, S_IRUSR|S_IWUSR ) != 0 )
+	{
+		::close( fd );
+		fd = -1;
+	}
+	if( fd >= 0 )
+	{
+		file = new QFile;
+		memory = file->open( fd, QFile::ReadWrite|QFile::Unbuffered, QFile::AutoCloseHandle );
+		if( !memory )
+			::close( fd );
+		// fileName() needs /proc, without it (sandbox, no procfs) use file on disk
+		else if( !QFile( fileName() ).open( QFile::ReadOnly ) )
+			memory = false;
+		if( !memory )
+		{
+			delete file;
+			file = nullptr;
+		}
+	}
+#endif
+	if( !memory && !spill() )
+		return false;
+	return QIODevice::open( mode|Unbuffered );
+}
+
+qint64 TempFile::readData( char *data, qint64 maxSize )
+{
+	return file->read( data, maxSize );
+}
+
+bool TempFile::seek( qint64 pos )
+{
+	return file && file->seek( pos ) && QIODevice::seek( pos );
+}
+
+qint64 TempFile::size() const
+{
+	return file ? file->size() : 0;
+}
+
+bool TempFile::spill()
+{
+	QTemporaryFile *tmp = new QTemporaryFile( QDir::tempPath() + "/XXXXXX" );
+	if( !tmp->open() )
+	{
+		setErrorString( tmp->errorString() );
+		delete tmp;
+		return false;
+	}
+	if( file )
+	{
+		// Current position is kept, content is copied in chunks
+		qint64 pos = file->pos();
+		QByteArray buf( 1024 * 1024, Qt::Uninitialized );
+		bool result = file->seek( 0 );
+		for( qint64 size = 0; result && (size = file->read( buf.data(), buf.size() )) != 0; )
+			result = size > 0 && tmp->write( buf.constData(), size ) == size;
+		if( !result || !tmp->seek( pos ) )
+		{
+			setErrorString( tmp->errorString() );
+			delete tmp;
+			return false;
+		}
+		delete file;
+	}
+	file = tmp;
+	memory = false;
+	return true;
+}
+
+qint64 TempFile::writeData( const char *data, qint64 size )
+{
+	if( memory && file->pos() + size > limit && !spill() )
+		return -1;
+	return file->write( data, size );
+}
@@ -0,0 +1,57 @@
+/*
+ * QDigiDocCrypto
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#pragma once
+
+#include <QtCore/QIODevice>
+
+class QFile;
+
+// Temporary storage of internal round-trips. Content is kept in anonymous memory file (Linux
+// memfd) and moved to temporary file on disk when it grows over limit or memory file is not
+// available. fileName() can be opened with QFile while device is open.
+class TempFile: public QIODevice
+{
+public:
+	explicit TempFile( qint64 limit = MEMORY_LIMIT );
+	~TempFile();
+
+	void close() override;
+	QString fileName() const;
+	bool flush();
+	bool isInMemory() const { return memory; }
+	bool isSequential() const override { return false; }
+	bool open( OpenMode mode = ReadWrite ) override;
+	bool seek( qint64 pos ) override;
+	qint64 size() const override;
+
+	static const qint64 MEMORY_LIMIT = 64 * 1024 * 1024;
+
+protected:
+	qint64 readData( char *data, qint64 maxSize ) override;
+	qint64 writeData( const char *data, qint64 size ) override;
+
+private:
+	Q_DISABLE_COPY(TempFile)
+	bool spill();
+
+	QFile *file = nullptr;
+	qint64 limit;
+	bool memory = false;
+};